@@ -3,6 +3,11 @@
 
 #define CONSOLE_PORT 0xE9
 #define FILE_PORT 0x0278
+#define DOORBELL_PORT 0x0279
+#define SHM_PORT 0x027A
+#define BALLOON_PORT 0x027B
+
+#define PAGE_SIZE 4096
 
 #define OPEN_FILE '0'
 #define CLOSE_FILE '1'
@@ -59,29 +64,193 @@ void sendToFilePort(const char *str) {
     }
 }
 
-void uintToStr(unsigned int num, char *str) {
-    char temp[20];
-    int i = 0;
+// guests are built without SSE, only the target functions below touch vector registers
+// 16 and 32 byte vectors, the u variants may be unaligned in memory
+typedef unsigned char v16 __attribute__((vector_size(16)));
+typedef unsigned char v16u __attribute__((vector_size(16), aligned(1)));
+typedef unsigned char v32u __attribute__((vector_size(32), aligned(1)));
+typedef char v16c __attribute__((vector_size(16)));
+typedef uint64_t v2u64 __attribute__((vector_size(16)));
 
-    if(num == 0) {
-        str[0] = '0';
-        str[1] = '\0';
-        return;
+uint32_t enabledXcr0() {
+    // XCR0 can only be read once the host set OSXSAVE, without it no vector state is enabled
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    if(!(ecx & (1U << 27))) return 0;
+    uint32_t lo, hi;
+    asm volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return lo;
+}
+
+int hasSse() {
+    // SSE only needs CR4.OSFXSR from the host, the guest runs at CPL0 and may read CR4
+    static int sse = -1;
+    if(sse < 0) {
+        uint64_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        sse = (cr4 & (1U << 9)) != 0;
     }
+    return sse;
+}
 
-    while(num > 0) {
-        temp[i++] = num % 10 + '0';
-        num /= 10;
+int hasAvx() {
+    // AVX needs the CPU feature, OSXSAVE set by the host and YMM state enabled in XCR0
+    static int avx = -1;
+    if(avx < 0) {
+        uint32_t eax, ebx, ecx, edx;
+        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+        avx = (ecx & (1U << 28)) && (enabledXcr0() & 6) == 6;
     }
+    return avx;
+}
 
-    int j = 0;
-    while(i > 0) {
-        str[j++] = temp[--i];
+__attribute__((target("avx")))
+void memcpyAvx(unsigned char *dst, const unsigned char *src, size_t n) {
+    for(; n >= 32; n -= 32, dst += 32, src += 32) {
+        *(v32u *) dst = *(const v32u *) src;
     }
-    str[j] = '\0';
+    asm volatile("vzeroupper");
+}
+
+__attribute__((target("avx")))
+void memsetAvx(unsigned char *dst, unsigned char c, size_t n) {
+    v32u value = (v32u){0} + c;
+    for(; n >= 32; n -= 32, dst += 32) {
+        *(v32u *) dst = value;
+    }
+    asm volatile("vzeroupper");
+}
+
+__attribute__((target("sse2")))
+void memcpySse(unsigned char *dst, const unsigned char *src, size_t n) {
+    for(; n >= 16; n -= 16, dst += 16, src += 16) {
+        *(v16u *) dst = *(const v16u *) src;
+    }
+}
+
+__attribute__((target("sse2")))
+void memsetSse(unsigned char *dst, unsigned char c, size_t n) {
+    v16 value = (v16){0} + c;
+    for(; n >= 16; n -= 16, dst += 16) {
+        *(v16u *) dst = value;
+    }
+}
+
+__attribute__((target("sse2")))
+size_t strlenSse(const char *str) {
+    // aligned 16 byte loads never cross into the next page
+    uintptr_t offset = (uintptr_t) str & 15;
+    const v16c *p = (const v16c *) (str - offset);
+    v16c zero = {0};
+    unsigned int mask = (unsigned int) __builtin_ia32_pmovmskb128(*p == zero) >> offset;
+    if(mask) return __builtin_ctz(mask);
+    for(;;) {
+        p++;
+        mask = __builtin_ia32_pmovmskb128(*p == zero);
+        if(mask) return (const char *) p - str + __builtin_ctz(mask);
+    }
+}
+
+__attribute__((target("sse2")))
+void ptrToStrSse(const void *ptr, char *str) {
+    // all 16 hex digits at once, most significant first
+    v16 bytes = (v16) (v2u64){__builtin_bswap64((uintptr_t) ptr), 0};
+    v16 spread = __builtin_shuffle(bytes, (v16){0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7});
+    v16 high = {0xFF, 0, 0xFF, 0, 0xFF, 0, 0xFF, 0, 0xFF, 0, 0xFF, 0, 0xFF, 0, 0xFF, 0};
+    v16 nibbles = ((spread >> 4) & high) | (spread & 0xF & ~high);
+    v16 letters = (v16) (nibbles > 9) & 7;
+    *(v16u *) str = nibbles + '0' + letters;
+    str[16] = '\0';
+}
+
+void *memcpy(void *dst, const void *src, size_t n) {
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    if(n >= 64 && hasAvx()) {
+        size_t done = n & ~(size_t) 31;
+        memcpyAvx(d, s, done);
+        d += done;
+        s += done;
+        n -= done;
+    }
+    if(n >= 16 && hasSse()) {
+        size_t done = n & ~(size_t) 15;
+        memcpySse(d, s, done);
+        d += done;
+        s += done;
+        n -= done;
+    }
+    while(n--) {
+        *d++ = *s++;
+    }
+    return dst;
+}
+
+void *memset(void *dst, int c, size_t n) {
+    unsigned char *d = dst;
+    if(n >= 64 && hasAvx()) {
+        size_t done = n & ~(size_t) 31;
+        memsetAvx(d, c, done);
+        d += done;
+        n -= done;
+    }
+    if(n >= 16 && hasSse()) {
+        size_t done = n & ~(size_t) 15;
+        memsetSse(d, c, done);
+        d += done;
+        n -= done;
+    }
+    while(n--) {
+        *d++ = c;
+    }
+    return dst;
+}
+
+size_t strlen(const char *str) {
+    if(hasSse()) return strlenSse(str);
+    const char *p = str;
+    while(*p) {
+        p++;
+    }
+    return p - str;
+}
+
+int appendStr(char *dst, int i, const char *src) {
+    size_t len = strlen(src);
+    memcpy(dst + i, src, len);
+    return i + len;
+}
+
+void uintToStr(unsigned int num, char *str) {
+    // two digits per division, written from the back
+    const char *digitPairs = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+    char temp[10];
+    int i = 10;
+
+    while(num >= 100) {
+        unsigned int pair = num % 100;
+        num /= 100;
+        i -= 2;
+        temp[i] = digitPairs[pair * 2];
+        temp[i + 1] = digitPairs[pair * 2 + 1];
+    }
+    if(num >= 10) {
+        i -= 2;
+        temp[i] = digitPairs[num * 2];
+        temp[i + 1] = digitPairs[num * 2 + 1];
+    } else {
+        temp[--i] = num + '0';
+    }
+
+    memcpy(str, temp + i, 10 - i);
+    str[10 - i] = '\0';
 }
 
 void ptrToStr(const void *ptr, char *str) {
+    if(hasSse()) {
+        ptrToStrSse(ptr, str);
+        return;
+    }
     uintptr_t value = (uintptr_t) ptr;
     char *hexDigits = "0123456789ABCDEF";
     int i = 0;
@@ -97,20 +266,11 @@ void *fopen(const char *filename, char *modes, const char *guest) {
     int i = 0;
     strToSend[i++] = OPEN_FILE;
     strToSend[i++] = '#';
-    while(*filename) {
-        strToSend[i++] = *filename;
-        filename++;
-    }
+    i = appendStr(strToSend, i, filename);
     strToSend[i++] = '#';
-    while(*modes) {
-        strToSend[i++] = *modes;
-        modes++;
-    }
+    i = appendStr(strToSend, i, modes);
     strToSend[i++] = '#';
-    while(*guest) {
-        strToSend[i++] = *guest;
-        guest++;
-    }
+    i = appendStr(strToSend, i, guest);
     strToSend[i++] = '/';
     strToSend[i++] = '#';
     strToSend[i++] = '#';
@@ -134,14 +294,9 @@ int fclose(void *file, const char *guest) {
     strToSend[i++] = CLOSE_FILE;
     strToSend[i++] = '#';
     ptrToStr(file, filePtrStr);
-    for(int j = 0; filePtrStr[j] != '\0'; j++) {
-        strToSend[i++] = filePtrStr[j];
-    }
+    i = appendStr(strToSend, i, filePtrStr);
     strToSend[i++] = '#';
-    while(*guest) {
-        strToSend[i++] = *guest;
-        guest++;
-    }
+    i = appendStr(strToSend, i, guest);
     strToSend[i++] = '/';
     strToSend[i++] = '#';
     strToSend[i++] = '#';
@@ -164,29 +319,18 @@ unsigned int fread(void *ptr, unsigned int size, unsigned int n, void **file, co
     strToSend[i++] = READ_FILE;
     strToSend[i++] = '#';
     ptrToStr(ptr, ptrStr);
-    for(int j = 0; ptrStr[j] != '\0'; j++) {
-        strToSend[i++] = ptrStr[j];
-    }
+    i = appendStr(strToSend, i, ptrStr);
     strToSend[i++] = '#';
     uintToStr(size, sizeStr);
-    for(int j = 0; sizeStr[j] != '\0'; j++) {
-        strToSend[i++] = sizeStr[j];
-    }
+    i = appendStr(strToSend, i, sizeStr);
     strToSend[i++] = '#';
     uintToStr(n, nStr);
-    for(int j = 0; nStr[j] != '\0'; j++) {
-        strToSend[i++] = nStr[j];
-    }
+    i = appendStr(strToSend, i, nStr);
     strToSend[i++] = '#';
     ptrToStr(*file, filePtrStr);
-    for(int j = 0; filePtrStr[j] != '\0'; j++) {
-        strToSend[i++] = filePtrStr[j];
-    }
+    i = appendStr(strToSend, i, filePtrStr);
     strToSend[i++] = '#';
-    while(*guest) {
-        strToSend[i++] = *guest;
-        guest++;
-    }
+    i = appendStr(strToSend, i, guest);
     strToSend[i++] = '/';
     strToSend[i++] = '#';
     strToSend[i++] = '#';
@@ -216,29 +360,18 @@ unsigned int fwrite(void *ptr, unsigned int size, unsigned int n, void **file, c
     strToSend[i++] = WRITE_FILE;
     strToSend[i++] = '#';
     ptrToStr(ptr, ptrStr);
-    for(int j = 0; ptrStr[j] != '\0'; j++) {
-        strToSend[i++] = ptrStr[j];
-    }
+    i = appendStr(strToSend, i, ptrStr);
     strToSend[i++] = '#';
     uintToStr(size, sizeStr);
-    for(int j = 0; sizeStr[j] != '\0'; j++) {
-        strToSend[i++] = sizeStr[j];
-    }
+    i = appendStr(strToSend, i, sizeStr);
     strToSend[i++] = '#';
     uintToStr(n, nStr);
-    for(int j = 0; nStr[j] != '\0'; j++) {
-        strToSend[i++] = nStr[j];
-    }
+    i = appendStr(strToSend, i, nStr);
     strToSend[i++] = '#';
     ptrToStr(*file, filePtrStr);
-    for(int j = 0; filePtrStr[j] != '\0'; j++) {
-        strToSend[i++] = filePtrStr[j];
-    }
+    i = appendStr(strToSend, i, filePtrStr);
     strToSend[i++] = '#';
-    while(*guest) {
-        strToSend[i++] = *guest;
-        guest++;
-    }
+    i = appendStr(strToSend, i, guest);
     strToSend[i++] = '/';
     strToSend[i++] = '#';
     strToSend[i++] = '#';
@@ -255,4 +388,40 @@ unsigned int fwrite(void *ptr, unsigned int size, unsigned int n, void **file, c
     *file = (void *) fileHandle;
 
     return ret;
-}
\ No newline at end of file
+}
+
+void *shmOpen(unsigned int index, unsigned int *size) {
+    // selects region index of --shm, host answers with its address and size
+    outl(SHM_PORT, index);
+    uint64_t address = inl(SHM_PORT);
+    *size = inl(SHM_PORT);
+    return (void *) address;
+}
+
+void shmNotify(unsigned int index) {
+    outl(DOORBELL_PORT, index);
+}
+
+unsigned int shmWait(unsigned int index) {
+    // returns once a peer rang the region since the last wait on it, 0 when no peer is left to ring it
+    unsigned int size;
+    shmOpen(index, &size);
+    return inl(DOORBELL_PORT);
+}
+
+unsigned int balloonTarget() {
+    // pages the host still wants back
+    return inl(BALLOON_PORT);
+}
+
+unsigned int balloonFree(void *start, size_t size) {
+    // reports the whole pages inside the range as free, they read as zero once touched again
+    uint64_t first = ((uint64_t) start + PAGE_SIZE - 1) & ~(uint64_t) (PAGE_SIZE - 1);
+    uint64_t end = ((uint64_t) start + size) & ~(uint64_t) (PAGE_SIZE - 1);
+    if(end > first) {
+        outl(BALLOON_PORT, (uint32_t) first);
+        outl(BALLOON_PORT, (uint32_t) (first >> 32));
+        outl(BALLOON_PORT, (uint32_t) ((end - first) / PAGE_SIZE));
+    }
+    return balloonTarget();
+}
@@ -0,0 +1,32 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../IO_library.c"
+
+#define GUEST_NAME "guest6"
+
+void
+__attribute__((noreturn))
+__attribute__((section(".start")))
+_start(void) {
+	// producer: shm[0] is the state, 1 when a message is ready, 2 when it was read
+	unsigned int size;
+	volatile char *shm = shmOpen(0, &size);
+	char message[40] = "Hello from guest6 over shared memory\n";
+	for(int i = 0; message[i] != '\0'; i++) {
+		shm[64 + i] = message[i];
+	}
+	shm[0] = 1;
+	shmNotify(0);
+
+	while(shm[0] != 2) {
+		if(shmWait(0) == 0) {
+			printf("guest6 has no reader left\n");
+			break;
+		}
+	}
+	if(shm[0] == 2) printf("guest6 got the ack\n");
+
+	for(;;)
+		asm("hlt");
+}
@@ -0,0 +1,28 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../IO_library.c"
+
+#define GUEST_NAME "guest7"
+
+void
+__attribute__((noreturn))
+__attribute__((section(".start")))
+_start(void) {
+	// consumer: prints what guest6 left in the shared memory and acks it
+	unsigned int size;
+	volatile char *shm = shmOpen(0, &size);
+	while(shm[0] != 1) {
+		if(shmWait(0) == 0) break;
+	}
+	if(shm[0] == 1) {
+		printf((const char *) shm + 64);
+		shm[0] = 2;
+		shmNotify(0);
+	} else {
+		printf("guest7 has no writer left\n");
+	}
+
+	for(;;)
+		asm("hlt");
+}
@@ -0,0 +1,42 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../IO_library.c"
+
+#define GUEST_NAME "guest8"
+
+// scratch memory between the image and the stack, at least -m 4
+#define SCRATCH ((char *) 0x100000)
+#define SCRATCH_SIZE (1024 * 1024)
+
+void
+__attribute__((noreturn))
+__attribute__((section(".start")))
+_start(void) {
+	// works on a megabyte, then gives as much of it back as the host asks for with --balloon
+	memset(SCRATCH, 'x', SCRATCH_SIZE);
+
+	char str[64] = "balloon target ";
+	char num[16];
+	unsigned int pages = balloonTarget();
+	uintToStr(pages, num);
+	int i = appendStr(str, 15, num);
+	i = appendStr(str, i, " pages\n");
+	str[i] = '\0';
+	printf(str);
+
+	if(pages > SCRATCH_SIZE / PAGE_SIZE) pages = SCRATCH_SIZE / PAGE_SIZE;
+	unsigned int left = balloonFree(SCRATCH, (size_t) pages * PAGE_SIZE);
+
+	i = appendStr(str, 0, "still wanted ");
+	uintToStr(left, num);
+	i = appendStr(str, i, num);
+	i = appendStr(str, i, " pages, first byte now ");
+	str[i++] = SCRATCH[0] ? SCRATCH[0] : '0';
+	i = appendStr(str, i, "\n");
+	str[i] = '\0';
+	printf(str);
+
+	for(;;)
+		asm("hlt");
+}
@@ -15,6 +15,23 @@
 #include <semaphore.h>
 #include <queue>
 #include <utility>
+#include <time.h>
+#include <memory>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <elf.h>
+#include <algorithm>
+#include <unordered_map>
+#include <set>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <linux/userfaultfd.h>
 
 using namespace std;
 
@@ -22,8 +39,12 @@ using namespace std;
 #define PDE64_RW (1U << 1)
 #define PDE64_USER (1U << 2)
 #define PDE64_PS (1U << 7)
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
 
 #define CR4_PAE (1U << 5)
+#define CR4_OSFXSR (1U << 9)
+#define CR4_OSXMMEXCPT (1U << 10)
+#define CR4_OSXSAVE (1U << 18)
 #define CR0_PE 1u
 #define CR0_MP (1U << 1)
 #define CR0_ET (1U << 4)
@@ -35,15 +56,85 @@ using namespace std;
 #define EFER_LME (1U << 8)
 #define EFER_LMA (1U << 10)
 
+#define XCR0_X87 (1ULL << 0)
+#define XCR0_SSE (1ULL << 1)
+#define XCR0_AVX (1ULL << 2)
+#define XCR0_AVX512 (7ULL << 5)
+
+#define CPUID_1_ECX_XSAVE (1U << 26)
+#define MAX_CPUID_ENTRIES 256
+
 #define CONSOLE_PORT 0xE9
 #define FILE_PORT 0x0278
+#define DOORBELL_PORT 0x0279
+#define SHM_PORT 0x027A
+#define BALLOON_PORT 0x027B
+
+#define OPEN_FILE '0'
+#define CLOSE_FILE '1'
+#define READ_FILE '2'
+#define WRITE_FILE '3'
+
+#define GUEST_PAGE_SIZE 4096
+
+//software TLB of guest translations the host made, direct mapped by virtual page number
+#define TLB_ENTRIES 64
+
+#define PROFILE_DEPTH 16
+
+//largest guest memory, everything from SHM_BASE on belongs to shared memory and MMIO
+#define MAX_MEMORY_MB 512
+
+//2MB window for MMIO devices, mapped in the page tables but never backed by a memory slot
+#define MMIO_BASE 0x30000000ULL
+#define MMIO_SIZE (2 * 1024 * 1024ULL)
 
-#define OPEN_FILE "0"
-#define CLOSE_FILE "1"
-#define READ_FILE "2"
-#define WRITE_FILE "3"
+//shared memory regions are mapped with 2MB pages from 512MB on, inside the single page directory
+//and below the MMIO window, a memory slot over it would swallow the MMIO exits
+#define SHM_BASE 0x20000000ULL
+#define SHM_ALIGN (2 * 1024 * 1024ULL)
+#define SHM_MAX_SIZE (MMIO_BASE - SHM_BASE)
+
+//when guest writes reach the disk: never forced, by close, or before each write returns
+#define DURABILITY_NONE 0
+#define DURABILITY_CLOSE 1
+#define DURABILITY_WRITE 2
+
+//the flusher writes in multiples of this, all of a file only when someone waits for it
+#define FLUSH_CHUNK (64 * 1024)
+//a writer waits while more than this of its file is buffered or being flushed
+#define WRITE_BEHIND_LIMIT (1024 * 1024)
+
+#define TRACE_MAGIC "HVTRACE2"
+#define TRACE_GUEST 'g'
+#define TRACE_CONSOLE_OUT 'o'
+#define TRACE_CONSOLE_IN 'i'
 
 sem_t mutex;
+sem_t traceMutex;
+sem_t poolMutex;
+sem_t jobsMutex;
+sem_t jobsAvailable;
+sem_t vcpusMutex;
+sem_t pagerMutex;
+FILE *traceFile = NULL;
+uint64_t traceStart;
+//false once probe_sse saw this KVM fail at guest SSE, guests then get neither OSFXSR nor XSAVE state
+bool guestSse = true;
+
+//one guest virtual 4K page, large guest pages fill one entry per 4K page the host touches
+struct tlbEntry {
+    uint64_t vpn;
+    uint64_t gpa;
+    bool writable;
+    bool valid;
+};
+
+//entries are only valid for the page tables cr3 pointed to when they were filled
+struct softTlb {
+    uint64_t cr3;
+    struct tlbEntry entries[TLB_ENTRIES];
+};
 
 struct vm {
     int kvm_fd;
@@ -51,23 +142,301 @@ struct vm {
     int vcpu_fd;
     char *mem;
     struct kvm_run *kvm_run;
+    int kvm_run_size;
     long mem_size;
     long page_size;
+    bool dirty_log;
+    uint64_t *host_dirty;
+    uint64_t shm_size;
+    uint64_t xcr0;
+    struct kvm_sregs initial_sregs;
+    struct softTlb tlb;
+    //--lazy memory, populated page by page by the pager thread
+    bool lazy;
+    int uffd;
+    int guest_id;
+    vector<char> image;
+    uint64_t *populated;
+    //pages the guest ballooned away, they fault back in as zeroes and not from the image
+    uint64_t *released;
+    long resident;
+    bool out_of_memory;
+};
+
+//per second rates a guest may use, 0 means unlimited
+struct ioLimits {
+    double ops;
+    double bytes;
+    double console;
+};
+
+struct tokenBucket {
+    double rate;
+    double tokens;
+    uint64_t last;
+};
+
+struct guestStats {
+    uint64_t fileOps;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t consoleBytes;
+    uint64_t throttled;
+    uint64_t throttledNs;
+    uint64_t residentPages;
+    uint64_t reclaimedPages;
+    uint64_t runNs;
+    uint64_t cpuNs;
+    uint64_t preempted;
+    bool timeLimited;
+    bool cpuLimited;
+};
+
+//memfd shared by every guest, with a doorbell guests ring to wake each other
+struct shmRegion {
+    string name;
+    uint64_t size;
+    uint64_t gpa;
+    int fd;
+    char *mem;
+    uint32_t seq;
+    pthread_mutex_t lock;
+    pthread_cond_t rung;
+};
+
+vector<struct shmRegion *> shmRegions;
+//guests that have the regions mapped or are about to, a doorbell wait needs one besides the waiter
+int shmGuests = 0;
+
+//a vCPU thread currently inside api(), that other threads may kick out of KVM_RUN
+struct vcpuThread {
+    pthread_t thread;
+    struct kvm_run *kvm_run;
+    //set by the profiler before its kick, so other kicks don't take samples
+    int *samplePending;
+};
+
+map<int, struct vcpuThread> vcpus;
+thread_local struct kvm_run *currentRun = NULL;
+//CLOCK_MONOTONIC ns when the guest's --time-limit runs out, blocking devices give up then, 0 for none
+thread_local uint64_t deviceDeadline = 0;
+
+struct symbol {
+    uint64_t addr;
+    uint64_t size;
+    string name;
+};
+
+//call stacks seen by the profiler, leaf first
+struct profile {
+    map<vector<uint64_t>, uint64_t> stacks;
+    uint64_t samples;
 };
 
 struct vmArgs {
     string guestArg;
+    int guestId;
     int memoryArg;
     int pageArg;
     vector<string> fileArgs;
+    struct ioLimits limits;
+    uint64_t balloonPages;
+    uint64_t timeLimitNs;
+    uint64_t cpuLimitNs;
 };
 
-int init_vm(struct vm *vm, long mem_size, long page_size) {
+struct cmdArgs {
+    int memoryArg;
+    int pageArg;
+    vector<string> guestArgs;
+    vector<string> fileArgs;
+    string traceArg;
+    string replayArg;
+    bool replayTiming;
+    string replayDirArg;
+    string daemonArg;
+    int workersArg;
+    int poolArg;
+    struct ioLimits limits;
+    map<string, struct ioLimits> guestLimits;
+    bool stats;
+    vector<pair<string, uint64_t>> shmArgs;
+    int profileArg;
+    bool lazy;
+    uint64_t memLimit;
+    uint64_t balloonPages;
+    int durability;
+    map<string, int> fileDurability;
+    uint64_t timeLimitNs;
+    uint64_t cpuLimitNs;
+    int maxRunning;
+    int sliceMs;
+};
+
+//a client of the daemon, closed once its reader and all of its jobs are done
+struct connection {
+    int fd;
+    sem_t writeMutex;
+
+    connection(int fd) : fd(fd) {
+        sem_init(&writeMutex, 0, 1);
+    }
+
+    ~connection() {
+        sem_destroy(&writeMutex);
+        close(fd);
+    }
+};
+
+struct job {
+    struct vmArgs vm;
+    shared_ptr<struct connection> conn;
+};
+
+//decoded request sent by the guest library to FILE_PORT
+struct fileRequest {
+    char op;
+    string name;
+    string mode;
+    string guestDir;
+    uint64_t ptr;
+    uint64_t size;
+    uint64_t n;
+    FILE *file;
+};
+
+struct fileReply {
+    uint64_t ret;
+    FILE *file;
+};
+
+//host side bookkeeping of the files one guest has opened
+struct fileState {
+    map<FILE *, string> fileNames;
+    map<FILE *, string> modes;
+    map<FILE *, long> cursors;
+    map<FILE *, bool> fileCopied;
+};
+
+//one record of the binary trace, followed by length bytes of '\0' terminated strings
+#pragma pack(push, 1)
+struct traceRecord {
+    uint8_t op;
+    uint16_t guest;
+    uint64_t time;
+    uint64_t duration;
+    uint64_t handle;
+    uint64_t ptr;
+    uint64_t size;
+    uint64_t n;
+    uint64_t ret;
+    uint64_t retHandle;
+    uint16_t length;
+};
+#pragma pack(pop)
+
+//passes the host CPUID through and picks the XCR0 that load_guest enables, x87 and SSE at least
+int setup_cpu(struct vm *vm) {
+    struct kvm_cpuid2 *cpuid = (struct kvm_cpuid2 *)calloc(1, sizeof(*cpuid) + MAX_CPUID_ENTRIES * sizeof(struct kvm_cpuid_entry2));
+    cpuid->nent = MAX_CPUID_ENTRIES;
+    if(ioctl(vm->kvm_fd, KVM_GET_SUPPORTED_CPUID, cpuid) < 0) {
+        perror("KVM_GET_SUPPORTED_CPUID");
+        free(cpuid);
+        return -1;
+    }
+
+    if(ioctl(vm->vcpu_fd, KVM_SET_CPUID2, cpuid) < 0) {
+        perror("KVM_SET_CPUID2");
+        free(cpuid);
+        return -1;
+    }
+
+    bool xsave = false;
+    uint64_t supported = 0;
+    for(uint32_t i = 0; i < cpuid->nent; i++) {
+        struct kvm_cpuid_entry2 &entry = cpuid->entries[i];
+        if(entry.function == 1) xsave = entry.ecx & CPUID_1_ECX_XSAVE;
+        if(entry.function == 0xd && entry.index == 0) supported = entry.eax | ((uint64_t)entry.edx << 32);
+    }
+    free(cpuid);
+
+    if(!guestSse || !xsave || ioctl(vm->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_XCRS) <= 0) return 0;
+
+    vm->xcr0 = XCR0_X87 | XCR0_SSE;
+    if(supported & XCR0_AVX) vm->xcr0 |= XCR0_AVX;
+    //AVX-512 state can only be enabled all together and on top of AVX
+    if((vm->xcr0 & XCR0_AVX) && (supported & XCR0_AVX512) == XCR0_AVX512) vm->xcr0 |= XCR0_AVX512;
+    return 0;
+}
+
+long committedPages = 0;
+long memLimitPages = 0;
+int pagerEpoll = -1;
+set<struct vm *> lazyVms;
+
+//hands faults on a lazy VM's memory to the pager thread, nothing is populated up front
+int init_lazy(struct vm *vm) {
+    vm->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if(vm->uffd < 0) {
+        perror("userfaultfd");
+        return -1;
+    }
+
+    struct uffdio_api api;
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    if(ioctl(vm->uffd, UFFDIO_API, &api) < 0) {
+        perror("UFFDIO_API");
+        return -1;
+    }
+
+    struct uffdio_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.range.start = (unsigned long)vm->mem;
+    reg.range.len = vm->mem_size;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if(ioctl(vm->uffd, UFFDIO_REGISTER, &reg) < 0) {
+        perror("UFFDIO_REGISTER");
+        return -1;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = vm;
+    sem_wait(&pagerMutex);
+    int ret = epoll_ctl(pagerEpoll, EPOLL_CTL_ADD, vm->uffd, &event);
+    if(ret == 0) lazyVms.insert(vm);
+    sem_post(&pagerMutex);
+    if(ret < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+int init_vm(struct vm *vm, long mem_size, long page_size, bool dirty_log, bool lazy) {
     struct kvm_userspace_memory_region region;
     int kvm_run_mmap_size;
 
     vm->mem_size = mem_size;
     vm->page_size = page_size;
+    vm->dirty_log = dirty_log;
+    vm->vm_fd = -1;
+    vm->vcpu_fd = -1;
+    vm->mem = (char *)MAP_FAILED;
+    vm->kvm_run = (struct kvm_run *)MAP_FAILED;
+    vm->host_dirty = new uint64_t[(mem_size / GUEST_PAGE_SIZE + 63) / 64]();
+    vm->shm_size = 0;
+    vm->xcr0 = 0;
+    vm->lazy = lazy;
+    vm->uffd = -1;
+    vm->guest_id = -1;
+    vm->populated = new uint64_t[(mem_size / GUEST_PAGE_SIZE + 63) / 64]();
+    vm->released = new uint64_t[(mem_size / GUEST_PAGE_SIZE + 63) / 64]();
+    vm->resident = 0;
+    vm->out_of_memory = false;
+    memset(&vm->tlb, 0, sizeof(vm->tlb));
 
     vm->kvm_fd = open("/dev/kvm", O_RDWR);
     if(vm->kvm_fd < 0) {
@@ -81,14 +450,20 @@ int init_vm(struct vm *vm, long mem_size, long page_size) {
         return -1;
     }
 
-    vm->mem = (char*)mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    //lazy memory is only reserved, the overcommit budget is checked by the pager instead
+    int flags = lazy ? MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE : MAP_SHARED | MAP_ANONYMOUS;
+    vm->mem = (char*)mmap(NULL, mem_size, PROT_READ | PROT_WRITE, flags, -1, 0);
     if(vm->mem == MAP_FAILED) {
         perror("mmap mem");
         return -1;
     }
 
+    if(lazy && init_lazy(vm) < 0) {
+        return -1;
+    }
+
     region.slot = 0;
-	region.flags = 0;
+	region.flags = dirty_log ? KVM_MEM_LOG_DIRTY_PAGES : 0;
     region.guest_phys_addr = 0;
     region.memory_size = mem_size;
     region.userspace_addr = (unsigned long)vm->mem;
@@ -97,6 +472,19 @@ int init_vm(struct vm *vm, long mem_size, long page_size) {
         return -1;
     }
 
+    for(size_t i = 0; i < shmRegions.size(); i++) {
+        region.slot = i + 1;
+        region.flags = 0;
+        region.guest_phys_addr = shmRegions[i]->gpa;
+        region.memory_size = shmRegions[i]->size;
+        region.userspace_addr = (unsigned long)shmRegions[i]->mem;
+        if(ioctl(vm->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
+            perror("KVM_SET_USER_MEMORY_REGION shm");
+            return -1;
+        }
+        vm->shm_size = shmRegions[i]->gpa + shmRegions[i]->size - SHM_BASE;
+    }
+
     vm->vcpu_fd = ioctl(vm->vm_fd, KVM_CREATE_VCPU, 0);
     if(vm->vcpu_fd < 0) {
         perror("KVM_CREATE_VCPU");
@@ -114,10 +502,140 @@ int init_vm(struct vm *vm, long mem_size, long page_size) {
         perror("mmap kvm_run");
         return -1;
     }
+    vm->kvm_run_size = kvm_run_mmap_size;
+
+    if(ioctl(vm->vcpu_fd, KVM_GET_SREGS, &vm->initial_sregs) < 0) {
+        perror("KVM_GET_SREGS");
+        return -1;
+    }
+
+    if(setup_cpu(vm) < 0) {
+        return -1;
+    }
 
     return 0;
 }
 
+//releases everything init_vm managed to set up, also after a failed init_vm
+void destroy_vm(struct vm *vm) {
+    //the pager must not be resolving a fault of this VM while it goes away
+    if(vm->uffd >= 0) {
+        sem_wait(&pagerMutex);
+        epoll_ctl(pagerEpoll, EPOLL_CTL_DEL, vm->uffd, NULL);
+        lazyVms.erase(vm);
+        close(vm->uffd);
+        sem_post(&pagerMutex);
+    }
+    __sync_fetch_and_sub(&committedPages, vm->resident);
+
+    if(vm->kvm_run != MAP_FAILED) munmap(vm->kvm_run, vm->kvm_run_size);
+    if(vm->mem != MAP_FAILED) munmap(vm->mem, vm->mem_size);
+    if(vm->vcpu_fd >= 0) close(vm->vcpu_fd);
+    if(vm->vm_fd >= 0) close(vm->vm_fd);
+    if(vm->kvm_fd >= 0) close(vm->kvm_fd);
+    delete[] vm->host_dirty;
+    delete[] vm->populated;
+    delete[] vm->released;
+}
+
+//remembers guest pages written by the host, KVM's dirty log only sees guest writes
+void mark_dirty(struct vm *vm, uint64_t addr, uint64_t len) {
+    if(!vm->dirty_log || len == 0) return;
+    for(uint64_t page = addr / GUEST_PAGE_SIZE; page <= (addr + len - 1) / GUEST_PAGE_SIZE && page < vm->mem_size / GUEST_PAGE_SIZE; page++) {
+        vm->host_dirty[page / 64] |= 1ULL << (page % 64);
+    }
+}
+
+//gives a lazy VM's memory back, the next guest faults its pages in again
+long drop_lazy(struct vm *vm) {
+    long dropped = vm->resident;
+    if(madvise(vm->mem, vm->mem_size, MADV_DONTNEED) < 0) {
+        perror("madvise");
+        return -1;
+    }
+    memset(vm->populated, 0, (vm->mem_size / GUEST_PAGE_SIZE + 63) / 64 * sizeof(uint64_t));
+    memset(vm->released, 0, (vm->mem_size / GUEST_PAGE_SIZE + 63) / 64 * sizeof(uint64_t));
+    memset(vm->host_dirty, 0, (vm->mem_size / GUEST_PAGE_SIZE + 63) / 64 * sizeof(uint64_t));
+    __sync_fetch_and_sub(&committedPages, dropped);
+    vm->resident = 0;
+    vm->out_of_memory = false;
+    return dropped;
+}
+
+//hands guest RAM the guest reported free back to the host, the guest reads zeroes there afterwards
+//shared anonymous memory only lets go of its pages with MADV_REMOVE, lazy memory drops them so the pager sees the next access
+//returns how many of the pages were actually resident, or -1
+long release_pages(struct vm *vm, uint64_t gpa, uint64_t len) {
+    long dropped = 0;
+    if(!vm->lazy) {
+        vector<unsigned char> resident(len / GUEST_PAGE_SIZE);
+        if(mincore(vm->mem + gpa, len, resident.data()) < 0) {
+            perror("mincore");
+            return -1;
+        }
+        for(unsigned char page : resident) dropped += page & 1;
+    }
+
+    //the pager reads the released bits while it resolves faults, so they are set before the pages go away
+    if(vm->lazy) {
+        sem_wait(&pagerMutex);
+        for(uint64_t page = gpa / GUEST_PAGE_SIZE; page < (gpa + len) / GUEST_PAGE_SIZE; page++) {
+            vm->released[page / 64] |= 1ULL << (page % 64);
+        }
+        sem_post(&pagerMutex);
+    }
+
+    if(madvise(vm->mem + gpa, len, vm->lazy ? MADV_DONTNEED : MADV_REMOVE) < 0) {
+        perror("madvise");
+        return -1;
+    }
+
+    //the pager updates the same bitmap words while it resolves faults
+    if(vm->lazy) {
+        sem_wait(&pagerMutex);
+        for(uint64_t page = gpa / GUEST_PAGE_SIZE; page < (gpa + len) / GUEST_PAGE_SIZE; page++) {
+            if(!(vm->populated[page / 64] & (1ULL << (page % 64)))) continue;
+            vm->populated[page / 64] &= ~(1ULL << (page % 64));
+            dropped++;
+        }
+        vm->resident -= dropped;
+        sem_post(&pagerMutex);
+        __sync_fetch_and_sub(&committedPages, dropped);
+    }
+    return dropped;
+}
+
+//zeroes only the pages dirtied by the last guest, returns how many or -1
+long reset_vm(struct vm *vm) {
+    long pages = vm->mem_size / GUEST_PAGE_SIZE;
+    long words = (pages + 63) / 64;
+    vector<uint64_t> bitmap(words);
+    struct kvm_dirty_log log;
+
+    memset(&log, 0, sizeof(log));
+    log.slot = 0;
+    log.dirty_bitmap = bitmap.data();
+    if(ioctl(vm->vm_fd, KVM_GET_DIRTY_LOG, &log) < 0) {
+        perror("KVM_GET_DIRTY_LOG");
+        return -1;
+    }
+
+    if(vm->lazy) return drop_lazy(vm);
+
+    long cleared = 0;
+    for(long w = 0; w < words; w++) {
+        uint64_t bits = bitmap[w] | vm->host_dirty[w];
+        vm->host_dirty[w] = 0;
+        while(bits) {
+            long page = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            memset(vm->mem + page * GUEST_PAGE_SIZE, 0, GUEST_PAGE_SIZE);
+            cleared++;
+        }
+    }
+    return cleared;
+}
+
 static void setup_64bit_code_segment(struct kvm_sregs *sregs) {
     struct kvm_segment seg = {
         0,              // base
@@ -141,21 +659,28 @@ static void setup_64bit_code_segment(struct kvm_sregs *sregs) {
     sregs->ds = sregs->es = sregs->fs = sregs->gs = sregs->ss = seg;
 }
 
+//page tables live at the top of guest memory, the stack starts right below them
+static long page_tables_size(struct vm *vm) {
+    long tables = 3;
+    if(vm->page_size == 4 * 1024) tables += vm->mem_size / (2 * 1024 * 1024);
+    return tables * GUEST_PAGE_SIZE;
+}
+
 static void setup_long_mode(struct vm *vm, struct kvm_sregs *sregs) {
     long mem_size = vm->mem_size;
     long page_size = vm->page_size;
 
     uint64_t page = 0;
-    uint64_t pml4_addr = 0x1000;
+    uint64_t pml4_addr = mem_size - page_tables_size(vm);
     uint64_t *pml4 = (uint64_t*)(vm->mem + pml4_addr);
 
-    uint64_t pdpt_addr = 0x2000;
+    uint64_t pdpt_addr = pml4_addr + 0x1000;
     uint64_t *pdpt = (uint64_t*)(vm->mem + pdpt_addr);
 
-    uint64_t pd_addr = 0x3000;
+    uint64_t pd_addr = pml4_addr + 0x2000;
     uint64_t *pd = (uint64_t*)(vm->mem + pd_addr);
 
-    uint64_t pt_addr = 0x4000;
+    uint64_t pt_addr = pml4_addr + 0x3000;
     uint64_t *pt = (uint64_t*)(vm->mem + pt_addr);
 
     pml4[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | pdpt_addr;
@@ -163,7 +688,7 @@ static void setup_long_mode(struct vm *vm, struct kvm_sregs *sregs) {
 
     if(page_size == 2 * 1024 * 1024) {
         uint64_t num_entries = mem_size / (2 * 1024 * 1024);
-        for (int i = 0; i < num_entries && i < 4; i++) {
+        for (uint64_t i = 0; i < num_entries; i++) {
             pd[i] = PDE64_PRESENT | PDE64_RW | PDE64_USER | PDE64_PS | page;
             page += 2 << 20;
         }
@@ -176,327 +701,2278 @@ static void setup_long_mode(struct vm *vm, struct kvm_sregs *sregs) {
                 page += 0x1000;
 		    }
             pt_addr += 0x1000;
+            pt += 512;
         }
     }
 
+    for(uint64_t addr = SHM_BASE; addr < SHM_BASE + vm->shm_size; addr += SHM_ALIGN) {
+        pd[addr / SHM_ALIGN] = PDE64_PRESENT | PDE64_RW | PDE64_USER | PDE64_PS | addr;
+    }
+    pd[MMIO_BASE / SHM_ALIGN] = PDE64_PRESENT | PDE64_RW | PDE64_USER | PDE64_PS | MMIO_BASE;
+
+    mark_dirty(vm, pml4_addr, pt_addr - pml4_addr);
+
     sregs->cr3 = pml4_addr;
+    //the guest library reads OSFXSR to decide whether it may use SSE
     sregs->cr4 = CR4_PAE;
-    sregs->cr0 = CR0_PE | CR0_PG;
+    if(guestSse) sregs->cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if(vm->xcr0 != 0) sregs->cr4 |= CR4_OSXSAVE;
+    sregs->cr0 = CR0_PE | CR0_MP | CR0_NE | CR0_PG;
     sregs->efer = EFER_LME | EFER_LMA;
 
     setup_64bit_code_segment(sregs);
 }
 
-vector<string> split(const string& str, char delimiter) {
-    vector<string> tokens;
-    string token;
-    istringstream tokenStream(str);
-    
-    while(getline(tokenStream, token, delimiter)) {
-        tokens.push_back(token);
+//host address of [gpa, gpa + len) if it lies inside guest RAM or inside one shm region, else NULL
+char *gpa_to_host(struct vm *vm, uint64_t gpa, uint64_t len) {
+    if(gpa < (uint64_t)vm->mem_size && len <= vm->mem_size - gpa) return vm->mem + gpa;
+    for(struct shmRegion *shm : shmRegions) {
+        if(gpa >= shm->gpa && gpa - shm->gpa < shm->size && len <= shm->size - (gpa - shm->gpa)) return shm->mem + (gpa - shm->gpa);
     }
-    
-    return tokens;
+    return NULL;
 }
 
-void pushFileHandleToQueue(FILE *file, queue<uint64_t> &sendBack) {
-    uint64_t leftHalf, rightHalf;
-    leftHalf = ((uintptr_t) file >> 32) & 0xFFFFFFFF;
-    rightHalf = (uintptr_t) file & 0xFFFFFFFF;
-    sendBack.push(leftHalf);
-    sendBack.push(rightHalf);
+//walks PML4, PDPT, PD and PT from cr3, stopping early at 1GB and 2MB pages
+static bool walk_page_tables(struct vm *vm, uint64_t cr3, uint64_t gva, struct tlbEntry *entry) {
+    uint64_t table = cr3 & PTE_ADDR_MASK;
+    bool writable = true;
+    for(int level = 3; level >= 0; level--) {
+        uint64_t *pte = (uint64_t *)gpa_to_host(vm, table + ((gva >> (12 + 9 * level)) & 511) * 8, 8);
+        if(pte == NULL || !(*pte & PDE64_PRESENT)) return false;
+        writable = writable && (*pte & PDE64_RW);
+
+        if(level == 0 || (level <= 2 && (*pte & PDE64_PS))) {
+            uint64_t offsetMask = (1ULL << (12 + 9 * level)) - 1;
+            entry->vpn = gva / GUEST_PAGE_SIZE;
+            entry->gpa = (*pte & PTE_ADDR_MASK & ~offsetMask) | (gva & offsetMask & ~(uint64_t)(GUEST_PAGE_SIZE - 1));
+            entry->writable = writable;
+            entry->valid = true;
+            return true;
+        }
+        table = *pte & PTE_ADDR_MASK;
+    }
+    return false;
 }
 
-uintptr_t strToPtr(string str) {
-    stringstream ss;
-    uintptr_t ptrValue;
-    ss << hex << str;
-    ss >> ptrValue;
-    return ptrValue;
-}
+//guest virtual to guest physical like the vCPU would see it right now
+//a guest that edits live mappings has to reload CR3 for the host to notice, as with invlpg on real TLBs
+static bool translate_gva(struct vm *vm, const struct kvm_sregs &sregs, uint64_t gva, bool write, uint64_t *gpa) {
+    if(!(sregs.cr0 & CR0_PG)) {
+        *gpa = gva;
+        return true;
+    }
+    //only canonical 48 bit addresses
+    if((uint64_t)((int64_t)(gva << 16) >> 16) != gva) return false;
 
-void api(struct vm vm, vector<string> fileArgs, string guest) {
-    int stop = 0;
-    int ret = 0;
-    char data;
+    if(vm->tlb.cr3 != sregs.cr3) {
+        memset(&vm->tlb, 0, sizeof(vm->tlb));
+        vm->tlb.cr3 = sregs.cr3;
+    }
 
-    string operation = "";
-    map<FILE *, string> fileNames;
-    map<FILE *, string> modes;
-    map<FILE *, long> cursors;
-    map<FILE *, bool> fileCopied;
-    queue<uint64_t> sendBack;
+    struct tlbEntry &entry = vm->tlb.entries[(gva / GUEST_PAGE_SIZE) % TLB_ENTRIES];
+    if(!entry.valid || entry.vpn != gva / GUEST_PAGE_SIZE) {
+        entry.valid = false;
+        if(!walk_page_tables(vm, sregs.cr3, gva, &entry)) return false;
+    }
+    //like the CPU, supervisor writes ignore read only pages unless CR0.WP is set
+    if(write && (sregs.cr0 & CR0_WP) && !entry.writable) return false;
 
-    while(stop == 0) {
-        ret = ioctl(vm.vcpu_fd, KVM_RUN, 0);
-        if(ret == -1) {
-            cout << "KVM_RUN failed" << endl;
-            return;
-        }
+    *gpa = entry.gpa | (gva & (GUEST_PAGE_SIZE - 1));
+    return true;
+}
 
-        switch(vm.kvm_run->exit_reason) {
-            case KVM_EXIT_IO:
-                if(vm.kvm_run->io.direction == KVM_EXIT_IO_OUT && vm.kvm_run->io.port == CONSOLE_PORT) {
-                    char *p = (char *)vm.kvm_run;
-                    cout << *(p + vm.kvm_run->io.data_offset);
-                } else if(vm.kvm_run->io.direction == KVM_EXIT_IO_IN && vm.kvm_run->io.port == CONSOLE_PORT) {
-                    scanf("%c", &data);
-                    char *data_in = (((char*)vm.kvm_run)+ vm.kvm_run->io.data_offset);
-                    (*data_in) = data;
-                } else if(vm.kvm_run->io.direction == KVM_EXIT_IO_OUT && vm.kvm_run->io.port == FILE_PORT) {
-                    sem_wait(&mutex);
-                    char *p = (char *)vm.kvm_run;
-                    operation += *(p + vm.kvm_run->io.data_offset);
-                    if(operation[operation.length() - 1] == '#' && operation[operation.length() - 1] == operation[operation.length() - 2]) {
-                        vector<string> args = split(operation, '#');
-                        operation = "";
-
-                        bool foundFile = false;
-                        string fileName = "";
-                        if(args[0] == OPEN_FILE) fileName = args[1];
-                        else if(args[0] == CLOSE_FILE) fileName = fileNames[reinterpret_cast<FILE *>(strToPtr(args[1]))];
-                        else if(args[0] == READ_FILE || args[0] == WRITE_FILE) fileName = fileNames[reinterpret_cast<FILE *>(strToPtr(args[4]))];
-                        
-                        for(int i = 0; i < fileArgs.size(); i++) {
-                            if(strcmp(fileArgs[i].c_str(), fileName.c_str()) == 0) {
-                                foundFile = true;
-                                break;
-                            }
-                        }
-                        
-                        if(foundFile) {
-                            //shared files
-                            if(args[0] == OPEN_FILE) {
-                                FILE* file = fopen(args[1].c_str(), args[2].c_str());
-                                fileNames[file] = args[1];
-                                modes[file] = args[2];
-                                fileCopied[file] = false;
-                                pushFileHandleToQueue(file, sendBack);
-                            } else if(args[0] == CLOSE_FILE) {
-                                FILE *file = reinterpret_cast<FILE *>(strToPtr(args[1]));
-                                uint64_t ret = fclose(file);
-                                sendBack.push(ret);
-                            } else if(args[0] == READ_FILE) {
-                                FILE *file = reinterpret_cast<FILE *>(strToPtr(args[4]));
-                                if(!fileCopied[file]) {
-                                    //reading from shared file, before first write
-                                    fseek(file, 0, cursors[file]);
-                                }
-
-                                char *buffer = new char[stoi(args[2]) * stoi(args[3])];
-                                uint64_t readCnt = fread(buffer, stoi(args[2]), stoi(args[3]), file);
-                                memcpy(vm.mem + strToPtr(args[1]), buffer, stoi(args[2]) * stoi(args[3]));
-                                delete[] buffer;
-
-                                if(!fileCopied[file]) {
-                                    cursors[file] = ftell(file);
-                                }
-                                sendBack.push(readCnt);
-                                pushFileHandleToQueue(file, sendBack);
-                            } else if(args[0] == WRITE_FILE) {
-                                FILE *file = reinterpret_cast<FILE *>(strToPtr(args[4]));
-                                if(!fileCopied[file]) {
-                                    //first write
-                                    FILE* file2 = fopen((args[5] + fileNames[file]).c_str(), modes[file].c_str());
-                                    fileNames[file2] = args[5] + fileNames[file];
-                                    modes[file2] = modes[file];
-                                    fileCopied[file2] = true;
-
-                                    //copying file to folder with private files
-                                    long cursorTemp = cursors[file];
-                                    fseek(file, 0, SEEK_SET);
-                                    char buffer[10];
-                                    size_t bytesRead;
-                                    while((bytesRead = fread(buffer, 1, 10, file)) > 0) {
-                                        fwrite(buffer, 1, bytesRead, file2);
-                                    }
-                                    fseek(file, 0, cursorTemp);
-                                    fseek(file2, 0, cursorTemp);
-                                    fclose(file);
-
-                                    char *buffer2 = new char[stoi(args[2]) * stoi(args[3])];
-                                    memcpy(buffer2, vm.mem + strToPtr(args[1]), stoi(args[2]) * stoi(args[3]));
-                                    uint64_t writeCnt = fwrite(buffer2, stoi(args[2]), stoi(args[3]), file2);
-                                    delete[] buffer2;
-
-                                    sendBack.push(writeCnt);
-                                    pushFileHandleToQueue(file2, sendBack);
-                                } else {
-                                    char *buffer = new char[stoi(args[2]) * stoi(args[3])];
-                                    memcpy(buffer, vm.mem + strToPtr(args[1]), stoi(args[2]) * stoi(args[3]));
-                                    uint64_t writeCnt = fwrite(buffer, stoi(args[2]), stoi(args[3]), file);
-                                    delete[] buffer;
-                                    
-                                    sendBack.push(writeCnt);
-                                    pushFileHandleToQueue(file, sendBack);
-                                }
-                            }
-                        } else {
-                            //private files
-                            if(args[0] == OPEN_FILE) {
-                                FILE* file = fopen((args[3] + args[1]).c_str(), args[2].c_str());
-                                fileNames[file] = args[3] + args[1];
-                                modes[file] = args[2];
-                                pushFileHandleToQueue(file, sendBack);
-                            } else if(args[0] == CLOSE_FILE) {
-                                FILE *file = reinterpret_cast<FILE *>(strToPtr(args[1]));
-                                uint64_t ret = fclose(file);
-                                sendBack.push(ret);
-                            } else if(args[0] == READ_FILE) {
-                                FILE *file = reinterpret_cast<FILE *>(strToPtr(args[4]));
-                                char *buffer = new char[stoi(args[2]) * stoi(args[3])];
-                                uint64_t readCnt = fread(buffer, stoi(args[2]), stoi(args[3]), file);
-                                memcpy(vm.mem + strToPtr(args[1]), buffer, stoi(args[2]) * stoi(args[3]));
-                                delete[] buffer;
-                                sendBack.push(readCnt);
-                                pushFileHandleToQueue(file, sendBack);
-                            } else if(args[0] == WRITE_FILE) {
-                                FILE *file = reinterpret_cast<FILE *>(strToPtr(args[4]));
-                                char *buffer = new char[stoi(args[2]) * stoi(args[3])];
-                                memcpy(buffer, vm.mem + strToPtr(args[1]), stoi(args[2]) * stoi(args[3]));
-                                uint64_t writeCnt = fwrite(buffer, stoi(args[2]), stoi(args[3]), file);
-                                delete[] buffer;
-                                sendBack.push(writeCnt);
-                                pushFileHandleToQueue(file, sendBack);
-                            }
-                        }
-                    }
-                    sem_post(&mutex);
-                } else if(vm.kvm_run->io.direction == KVM_EXIT_IO_IN && vm.kvm_run->io.port == FILE_PORT) {
-                    sem_wait(&mutex);
-                    char *ptr = reinterpret_cast<char *>(vm.kvm_run) + vm.kvm_run->io.data_offset;
-                    if(!sendBack.empty()) {
-                        uint64_t value = sendBack.front();
-                        sendBack.pop();
-                        memcpy(ptr, &value, vm.kvm_run->io.size);
-                    }
-                    sem_post(&mutex);         
-                }
-                continue;
-            case KVM_EXIT_HLT:
-                cout << "KVM_EXIT_HLT" << endl;
-                stop = 1;
-                break;
-            case KVM_EXIT_INTERNAL_ERROR:
-                cout << "Internal error: suberror = 0x" << hex << vm.kvm_run->internal.suberror << endl;
-                stop = 1;
-                break;
-            case KVM_EXIT_SHUTDOWN:
-                cout << "Shutdown" << endl;
-                stop = 1;
-                break;
-            default:
-                cout << "Exit reason: " << vm.kvm_run->exit_reason << endl;
-                break;
-        }
+//splits a guest buffer into host ranges, pages that are contiguous on the host share one range
+bool guest_buffer(struct vm *vm, const struct kvm_sregs &sregs, uint64_t gva, uint64_t len, bool write, vector<struct iovec> &iov) {
+    iov.clear();
+    while(len > 0) {
+        uint64_t gpa;
+        uint64_t chunk = min(len, GUEST_PAGE_SIZE - (gva & (GUEST_PAGE_SIZE - 1)));
+        if(!translate_gva(vm, sregs, gva, write, &gpa)) return false;
+        char *host = gpa_to_host(vm, gpa, chunk);
+        if(host == NULL) return false;
+
+        if(!iov.empty() && (char *)iov.back().iov_base + iov.back().iov_len == host) iov.back().iov_len += chunk;
+        else iov.push_back({host, chunk});
+        gva += chunk;
+        len -= chunk;
     }
+    return true;
 }
 
-void vmRunner(struct vmArgs arg) {
-    string guestArg = arg.guestArg;
-    int memoryArg = arg.memoryArg;
-    int pageArg = arg.pageArg;
-    vector<string> fileArgs = arg.fileArgs;
-    struct vm vm;
-    struct kvm_sregs sregs;
-    struct kvm_regs regs;
-    ifstream img;
+uint64_t iovLength(const vector<struct iovec> &iov) {
+    uint64_t len = 0;
+    for(const auto& range : iov) len += range.iov_len;
+    return len;
+}
 
-    long memorySize = memoryArg * 1024 * 1024;
-    long pageSize;
-    if(pageArg == 2) pageSize = 2 * 1024 * 1024;
-    else if(pageArg == 4) pageSize = 4 * 1024;
-    if(init_vm(&vm, memorySize, pageSize)) {
-        cout << "Failed to init the VM" << endl;
-        return;
+void copyToGuest(const vector<struct iovec> &iov, const char *src) {
+    for(const auto& range : iov) {
+        memcpy(range.iov_base, src, range.iov_len);
+        src += range.iov_len;
     }
+}
 
-    if(ioctl(vm.vcpu_fd, KVM_GET_SREGS, &sregs) < 0) {
-        perror("KVM_GET_SREGS");
-        return;
+void copyFromGuest(char *dst, const vector<struct iovec> &iov) {
+    for(const auto& range : iov) {
+        memcpy(dst, range.iov_base, range.iov_len);
+        dst += range.iov_len;
     }
+}
 
-    setup_long_mode(&vm, &sregs);
+//creates the --shm regions, laid out one after another from SHM_BASE
+int init_shm(const vector<pair<string, uint64_t>> &shmArgs) {
+    uint64_t gpa = SHM_BASE;
+    for(const auto& shmArg : shmArgs) {
+        struct shmRegion *shm = new struct shmRegion;
+        shm->name = shmArg.first;
+        shm->size = (shmArg.second + SHM_ALIGN - 1) / SHM_ALIGN * SHM_ALIGN;
+        shm->gpa = gpa;
+        shm->seq = 0;
+        shm->fd = -1;
+        shm->mem = (char *)MAP_FAILED;
+        pthread_mutex_init(&shm->lock, NULL);
+        //deadlines are on CLOCK_MONOTONIC like nowNs
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&shm->rung, &attr);
+        pthread_condattr_destroy(&attr);
+        shmRegions.push_back(shm);
+
+        //also catches sizes that wrapped around when rounded up
+        if(shm->size == 0 || shm->size > SHM_MAX_SIZE || gpa + shm->size > SHM_BASE + SHM_MAX_SIZE) {
+            cout << "Shared memory regions can't be larger than " << (SHM_MAX_SIZE >> 20) << "MB in total" << endl;
+            return -1;
+        }
+        if(gpa < MMIO_BASE + MMIO_SIZE && gpa + shm->size > MMIO_BASE) {
+            cout << "Shared memory regions can't overlap the MMIO window" << endl;
+            return -1;
+        }
+        gpa += shm->size;
 
-    if(ioctl(vm.vcpu_fd, KVM_SET_SREGS, &sregs) < 0) {
-        perror("KVM_SET_SREGS");
-        return;
+        shm->fd = memfd_create(shm->name.c_str(), MFD_CLOEXEC);
+        if(shm->fd < 0) {
+            perror("memfd_create");
+            return -1;
+        }
+        if(ftruncate(shm->fd, shm->size) < 0) {
+            perror("ftruncate shm");
+            return -1;
+        }
+        shm->mem = (char *)mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+        if(shm->mem == MAP_FAILED) {
+            perror("mmap shm");
+            return -1;
+        }
     }
+    return 0;
+}
 
-    memset(&regs, 0, sizeof(regs));
-    regs.rflags = 2;
-    regs.rip = 0;
-    regs.rsp = memorySize;
-
-    if(ioctl(vm.vcpu_fd, KVM_SET_REGS, &regs) < 0) {
-        perror("KVM_SET_REGS");
-        return;
+void destroy_shm() {
+    for(struct shmRegion *shm : shmRegions) {
+        if(shm->mem != MAP_FAILED) munmap(shm->mem, shm->size);
+        if(shm->fd >= 0) close(shm->fd);
+        pthread_cond_destroy(&shm->rung);
+        pthread_mutex_destroy(&shm->lock);
+        delete shm;
     }
+    shmRegions.clear();
+}
 
-    img.open(guestArg, ios::binary);
-    if(!img.is_open()) {
-        cout << "Can not open binary file" << endl;
-        return;
-    }
+//a guest that was up to date does not wake itself with its own ring
+void shmRing(uint32_t index, vector<uint32_t> &seen) {
+    if(index >= shmRegions.size()) return;
+    struct shmRegion *shm = shmRegions[index];
+    pthread_mutex_lock(&shm->lock);
+    if(seen[index] == shm->seq) seen[index]++;
+    shm->seq++;
+    pthread_cond_broadcast(&shm->rung);
+    pthread_mutex_unlock(&shm->lock);
+}
 
-    char *p = vm.mem;
-    while(!img.eof()) {
-        img.read(p, 1024);
-        p += img.gcount();
+void shmAttach(int guests) {
+    __sync_fetch_and_add(&shmGuests, guests);
+}
+
+//wakes the waiters so they notice when the last peer is gone
+void shmDetach() {
+    __sync_fetch_and_sub(&shmGuests, 1);
+    for(struct shmRegion *shm : shmRegions) {
+        pthread_mutex_lock(&shm->lock);
+        pthread_cond_broadcast(&shm->rung);
+        pthread_mutex_unlock(&shm->lock);
     }
-    img.close();
+}
 
-    api(vm, fileArgs, guestArg);
+uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-bool parseArgs(int argc, char *argv[], int *memoryArg, int *pageArg, vector<string> &guestArgs, vector<string> &fileArgs) {
-    for(int i = 1; i < argc; ) {
-        if(strcmp(argv[i], "--memory") == 0 || strcmp(argv[i], "-m") == 0)  {
-            if(strcmp(argv[i + 1], "2") && strcmp(argv[i + 1], "4") && strcmp(argv[i + 1], "8")) return false;
-            *memoryArg = atoi(argv[i + 1]);
-            i += 2;
-        } else if(strcmp(argv[i], "--page") == 0 || strcmp(argv[i], "-p") == 0) {
-            if(strcmp(argv[i + 1], "2") && strcmp(argv[i + 1], "4")) return false;
-            *pageArg = atoi(argv[i + 1]);
-            i += 2;
-        } else if(strcmp(argv[i], "--guest") == 0 || strcmp(argv[i], "-g") == 0) {
-            i++;
-            while(i < argc) {
-                if(strcmp(argv[i], "--memory") == 0 || strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--page") == 0 || strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--file") == 0 || strcmp(argv[i], "-f") == 0) break;
-                guestArgs.emplace_back(argv[i]);
-                i++;
-            }
-        } else if(strcmp(argv[i], "--file") == 0 || strcmp(argv[i], "-f") == 0) {
-            i++;
-            while(i < argc) {
-                if(strcmp(argv[i], "--memory") == 0 || strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--page") == 0 || strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--guest") == 0 || strcmp(argv[i], "-g") == 0) break;
-                fileArgs.emplace_back(argv[i]);
-                i++;
-            }
-        } else {
-            return false;
-        }
-    }
-    return true;
+//CPU time of the calling thread, which includes the time its vCPU spent running the guest
+uint64_t threadCpuNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-int main(int argc, char *argv[]) {
-    if(argc < 7) {
-        cout << "Run program like this ./mini_hypervisor [--memory or -m] [2, 4 or 8] [--page or -p] [2 or 4] [--guest or -g] guest1/guest1.img guest2/guest2.img [--file or -f] lorem1.txt lorem2.txt" << endl;
-        return 1;
-    }
+//kicks interrupt nanosleep, the rest of the time is still slept
+void sleepNs(uint64_t ns) {
+    struct timespec ts = {(time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL)};
+    while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
 
-    sem_init(&mutex, 0, 1);
+//if the signal lands outside KVM_RUN, immediate_exit makes the next KVM_RUN return right away
+void kickHandler(int sig) {
+    if(currentRun != NULL) currentRun->immediate_exit = 1;
+}
 
-    int memoryArg;
-    int pageArg;
-    vector<string> guestArgs;
+void install_kick_handler() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = kickHandler;
+    //KVM_RUN still returns EINTR, but blocking reads like the console's are not cut short
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+void registerVcpu(int guestId, struct kvm_run *kvm_run, int *samplePending) {
+    currentRun = kvm_run;
+    sem_wait(&vcpusMutex);
+    vcpus[guestId] = {pthread_self(), kvm_run, samplePending};
+    sem_post(&vcpusMutex);
+}
+
+void unregisterVcpu(int guestId) {
+    sem_wait(&vcpusMutex);
+    vcpus.erase(guestId);
+    sem_post(&vcpusMutex);
+    currentRun = NULL;
+}
+
+void kickVcpu(const struct vcpuThread &vcpu) {
+    pthread_kill(vcpu.thread, SIGUSR1);
+}
+
+//FIFO run tokens, at most --max-running guests are inside KVM_RUN and the rest wait their turn
+//a ticket is admitted once runAdmitted passed it, every release admits the next one
+pthread_mutex_t runLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t runTurn = PTHREAD_COND_INITIALIZER;
+uint64_t runNextTicket = 0;
+uint64_t runAdmitted = 0;
+int maxRunning = 0;
+uint64_t sliceNs = 10000000ULL;
+int limitedGuests = 0;
+bool schedulerStop = false;
+
+//whether this thread holds a run token and since when, a fresh token starts a fresh slice
+thread_local bool runHeld = false;
+thread_local uint64_t runSliceStart = 0;
+
+void runAcquire() {
+    runSliceStart = nowNs();
+    if(maxRunning == 0) return;
+    pthread_mutex_lock(&runLock);
+    uint64_t ticket = runNextTicket++;
+    while(ticket >= runAdmitted) pthread_cond_wait(&runTurn, &runLock);
+    pthread_mutex_unlock(&runLock);
+    runHeld = true;
+    runSliceStart = nowNs();
+}
+
+void runRelease() {
+    if(maxRunning == 0) return;
+    runHeld = false;
+    pthread_mutex_lock(&runLock);
+    runAdmitted++;
+    pthread_cond_broadcast(&runTurn);
+    pthread_mutex_unlock(&runLock);
+}
+
+bool runWaiting() {
+    if(maxRunning == 0) return false;
+    pthread_mutex_lock(&runLock);
+    bool waiting = runNextTicket > runAdmitted;
+    pthread_mutex_unlock(&runLock);
+    return waiting;
+}
+
+//a device wait hands the run token on once it is sure to block, and queues for it again when done
+//device exits that don't block keep the token, so I/O-bound guests keep their place in the queue
+struct runBlocked {
+    bool released;
+
+    runBlocked() : released(false) {}
+
+    void begin() {
+        if(released || !runHeld) return;
+        runRelease();
+        released = true;
+    }
+
+    ~runBlocked() {
+        if(released) runAcquire();
+    }
+};
+
+//blocks until the region was rung since the guest last waited on it, 0 when no other guest is left to ring it
+//or the guest's time limit ran out
+uint32_t shmWait(uint32_t index, vector<uint32_t> &seen) {
+    if(index >= shmRegions.size()) return 0;
+    struct shmRegion *shm = shmRegions[index];
+    struct timespec deadline = {(time_t)(deviceDeadline / 1000000000ULL), (long)(deviceDeadline % 1000000000ULL)};
+    uint32_t ret = 0;
+    struct runBlocked blocked;
+    pthread_mutex_lock(&shm->lock);
+    while(shm->seq == seen[index] && shmGuests > 1) {
+        blocked.begin();
+        if(deviceDeadline == 0) pthread_cond_wait(&shm->rung, &shm->lock);
+        else if(pthread_cond_timedwait(&shm->rung, &shm->lock, &deadline) == ETIMEDOUT) break;
+    }
+    if(shm->seq != seen[index]) {
+        seen[index] = shm->seq;
+        ret = seen[index];
+    }
+    pthread_mutex_unlock(&shm->lock);
+    return ret;
+}
+
+//kicks every vCPU once per slice while guests wait for a run token or have time limits to check
+void scheduler() {
+    while(!schedulerStop) {
+        sleepNs(sliceNs);
+        if(!runWaiting() && limitedGuests == 0) continue;
+        sem_wait(&vcpusMutex);
+        for(const auto& vcpu : vcpus) {
+            kickVcpu(vcpu.second);
+        }
+        sem_post(&vcpusMutex);
+    }
+}
+
+//stops a guest that went over --mem-limit, its fault is still resolved so it can leave KVM_RUN
+void outOfMemory(struct vm *vm) {
+    vm->out_of_memory = true;
+    sem_wait(&vcpusMutex);
+    auto vcpu = vcpus.find(vm->guest_id);
+    if(vcpu != vcpus.end()) kickVcpu(vcpu->second);
+    sem_post(&vcpusMutex);
+}
+
+//maps the faulting page from the guest image, or the zero page past its end and for ballooned pages
+void resolve_fault(struct vm *vm, uint64_t address) {
+    uint64_t offset = (address - (uint64_t)vm->mem) & ~(uint64_t)(GUEST_PAGE_SIZE - 1);
+    long page = offset / GUEST_PAGE_SIZE;
+    int ret;
+
+    if(offset < vm->image.size() && !(vm->released[page / 64] & (1ULL << (page % 64)))) {
+        char buffer[GUEST_PAGE_SIZE] = {0};
+        memcpy(buffer, vm->image.data() + offset, min((uint64_t)GUEST_PAGE_SIZE, vm->image.size() - offset));
+        struct uffdio_copy copy;
+        memset(&copy, 0, sizeof(copy));
+        copy.dst = (unsigned long)vm->mem + offset;
+        copy.src = (unsigned long)buffer;
+        copy.len = GUEST_PAGE_SIZE;
+        ret = ioctl(vm->uffd, UFFDIO_COPY, &copy);
+    } else {
+        struct uffdio_zeropage zero;
+        memset(&zero, 0, sizeof(zero));
+        zero.range.start = (unsigned long)vm->mem + offset;
+        zero.range.len = GUEST_PAGE_SIZE;
+        ret = ioctl(vm->uffd, UFFDIO_ZEROPAGE, &zero);
+    }
+
+    //EEXIST means the page showed up on its own, e.g. two threads faulted on it
+    if(ret < 0 && errno != EEXIST) {
+        perror("resolve fault");
+        return;
+    }
+    if(ret < 0 || (vm->populated[page / 64] & (1ULL << (page % 64)))) return;
+
+    vm->populated[page / 64] |= 1ULL << (page % 64);
+    vm->resident++;
+    long committed = __sync_add_and_fetch(&committedPages, 1);
+    if(memLimitPages > 0 && committed > memLimitPages && !vm->out_of_memory) outOfMemory(vm);
+}
+
+//resolves the faults of every lazy VM, which registered its userfaultfd with pagerEpoll
+void pager() {
+    struct epoll_event events[16];
+    for(;;) {
+        int n = epoll_wait(pagerEpoll, events, 16, -1);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) {
+            perror("epoll_wait");
+            return;
+        }
+
+        sem_wait(&pagerMutex);
+        for(int i = 0; i < n; i++) {
+            struct vm *vm = (struct vm *)events[i].data.ptr;
+            struct uffd_msg msg;
+            //skips VMs destroyed since epoll_wait returned
+            if(!lazyVms.count(vm)) continue;
+            while(read(vm->uffd, &msg, sizeof(msg)) == sizeof(msg)) {
+                if(msg.event == UFFD_EVENT_PAGEFAULT) resolve_fault(vm, msg.arg.pagefault.address);
+            }
+        }
+        sem_post(&pagerMutex);
+    }
+}
+
+bool profilerStop = false;
+
+void profiler(int hz) {
+    while(!profilerStop) {
+        sleepNs(1000000000ULL / hz);
+        sem_wait(&vcpusMutex);
+        for(const auto& vcpu : vcpus) {
+            __sync_lock_test_and_set(vcpu.second.samplePending, 1);
+            kickVcpu(vcpu.second);
+        }
+        sem_post(&vcpusMutex);
+    }
+}
+
+//records rip and the return addresses found by following the guest's frame pointers
+void sampleGuest(struct vm *vm, struct profile *prof) {
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    if(ioctl(vm->vcpu_fd, KVM_GET_REGS, &regs) < 0 || ioctl(vm->vcpu_fd, KVM_GET_SREGS, &sregs) < 0) return;
+
+    vector<uint64_t> stack;
+    vector<struct iovec> iov;
+    stack.push_back(regs.rip);
+    uint64_t rbp = regs.rbp;
+    while(stack.size() < PROFILE_DEPTH && rbp != 0 && rbp % 8 == 0 && guest_buffer(vm, sregs, rbp, 16, false, iov)) {
+        uint64_t frame[2];
+        copyFromGuest((char *)frame, iov);
+        uint64_t next = frame[0], ret = frame[1];
+        if(ret == 0) break;
+        stack.push_back(ret - 1);
+        if(next <= rbp) break;
+        rbp = next;
+    }
+
+    prof->stacks[stack]++;
+    prof->samples++;
+}
+
+//function symbols of a guest's ELF, sorted by address
+vector<struct symbol> loadSymbols(const string &path) {
+    vector<struct symbol> symbols;
+    ifstream elf(path, ios::binary);
+    if(!elf.is_open()) return symbols;
+    string data((istreambuf_iterator<char>(elf)), istreambuf_iterator<char>());
+
+    Elf64_Ehdr ehdr;
+    if(data.size() < sizeof(ehdr)) return symbols;
+    memcpy(&ehdr, data.data(), sizeof(ehdr));
+    if(memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 || ehdr.e_ident[EI_CLASS] != ELFCLASS64) return symbols;
+    if(ehdr.e_shoff + (uint64_t)ehdr.e_shnum * sizeof(Elf64_Shdr) > data.size()) return symbols;
+
+    const Elf64_Shdr *shdrs = (const Elf64_Shdr *)(data.data() + ehdr.e_shoff);
+    for(int i = 0; i < ehdr.e_shnum; i++) {
+        if(shdrs[i].sh_type != SHT_SYMTAB || shdrs[i].sh_link >= ehdr.e_shnum) continue;
+        const Elf64_Shdr &strtab = shdrs[shdrs[i].sh_link];
+        if(shdrs[i].sh_offset + shdrs[i].sh_size > data.size() || strtab.sh_offset + strtab.sh_size > data.size()) continue;
+
+        const Elf64_Sym *syms = (const Elf64_Sym *)(data.data() + shdrs[i].sh_offset);
+        for(size_t j = 0; j < shdrs[i].sh_size / sizeof(Elf64_Sym); j++) {
+            if(ELF64_ST_TYPE(syms[j].st_info) != STT_FUNC || syms[j].st_name >= strtab.sh_size) continue;
+            symbols.push_back({syms[j].st_value, syms[j].st_size, string(data.data() + strtab.sh_offset + syms[j].st_name)});
+        }
+    }
+
+    sort(symbols.begin(), symbols.end(), [](const struct symbol &a, const struct symbol &b) { return a.addr < b.addr; });
+    return symbols;
+}
+
+string symbolize(const vector<struct symbol> &symbols, uint64_t addr) {
+    auto it = upper_bound(symbols.begin(), symbols.end(), addr, [](uint64_t addr, const struct symbol &sym) { return addr < sym.addr; });
+    if(it != symbols.begin()) {
+        --it;
+        if(it->size == 0 || addr < it->addr + it->size) return it->name;
+    }
+    ostringstream str;
+    str << "0x" << hex << addr;
+    return str.str();
+}
+
+string stripImg(const string &guest) {
+    if(guest.size() > 4 && guest.compare(guest.size() - 4, 4, ".img") == 0) return guest.substr(0, guest.size() - 4);
+    return guest;
+}
+
+//writes guestx/guestx.folded, one "guestx;_start;...;leaf count" line per stack, symbols from guestx/guestx.elf
+void writeProfile(const string &guest, const struct profile &prof) {
+    string base = stripImg(guest);
+    vector<struct symbol> symbols = loadSymbols(base + ".elf");
+    string name = base.substr(base.find_last_of('/') + 1);
+
+    map<string, uint64_t> folded;
+    for(const auto& stack : prof.stacks) {
+        string line = name;
+        for(auto it = stack.first.rbegin(); it != stack.first.rend(); ++it) {
+            line += ";" + symbolize(symbols, *it);
+        }
+        folded[line] += stack.second;
+    }
+
+    ofstream out(base + ".folded");
+    for(const auto& line : folded) {
+        out << line.first << " " << line.second << "\n";
+    }
+    cout << guest + ": " << prof.samples << " samples written to " + base + ".folded\n";
+}
+
+vector<string> split(const string& str, char delimiter) {
+    vector<string> tokens;
+    string token;
+    istringstream tokenStream(str);
+    
+    while(getline(tokenStream, token, delimiter)) {
+        tokens.push_back(token);
+    }
+    
+    return tokens;
+}
+
+void pushFileHandleToQueue(FILE *file, queue<uint64_t> &sendBack) {
+    uint64_t leftHalf, rightHalf;
+    leftHalf = ((uintptr_t) file >> 32) & 0xFFFFFFFF;
+    rightHalf = (uintptr_t) file & 0xFFFFFFFF;
+    sendBack.push(leftHalf);
+    sendBack.push(rightHalf);
+}
+
+//throws invalid_argument or out_of_range on anything but a hex number
+uintptr_t strToPtr(string str) {
+    size_t end;
+    uintptr_t ptrValue = stoull(str, &end, 16);
+    if(end != str.size()) throw invalid_argument(str);
+    return ptrValue;
+}
+
+void initBucket(struct tokenBucket &bucket, double rate) {
+    bucket.rate = rate;
+    bucket.tokens = rate;
+    bucket.last = nowNs();
+}
+
+//takes amount tokens, going into debt if needed, and returns how long the caller has to wait it off
+uint64_t takeTokens(struct tokenBucket &bucket, double amount) {
+    if(bucket.rate <= 0) return 0;
+
+    //refill, holding at most one second worth of tokens
+    uint64_t now = nowNs();
+    bucket.tokens = min(bucket.rate, bucket.tokens + (now - bucket.last) * bucket.rate / 1e9);
+    bucket.last = now;
+
+    bucket.tokens -= amount;
+    if(bucket.tokens >= 0) return 0;
+    return (uint64_t)(-bucket.tokens / bucket.rate * 1e9);
+}
+
+void throttle(struct guestStats *stats, uint64_t ns) {
+    //no point in waiting past the time limit, the guest is stopped right after this request
+    if(deviceDeadline > 0) ns = min(ns, deviceDeadline - min(deviceDeadline, nowNs()));
+    if(ns == 0) return;
+    stats->throttled++;
+    stats->throttledNs += ns;
+    struct runBlocked blocked;
+    blocked.begin();
+    sleepNs(ns);
+}
+
+string formatStats(const struct guestStats &stats) {
+    ostringstream str;
+    str << stats.fileOps << " file ops, " << stats.bytesRead << " bytes read, " << stats.bytesWritten << " bytes written, ";
+    str << stats.consoleBytes << " console bytes, throttled " << stats.throttled << " times for " << stats.throttledNs / 1000000 << " ms";
+    if(stats.residentPages > 0) str << ", " << stats.residentPages * GUEST_PAGE_SIZE / 1024 << " KB resident";
+    if(stats.reclaimedPages > 0) str << ", " << stats.reclaimedPages * GUEST_PAGE_SIZE / 1024 << " KB reclaimed";
+    str << ", ran " << stats.runNs / 1000000 << " ms using " << stats.cpuNs / 1000000 << " ms CPU, preempted " << stats.preempted << " times";
+    return str.str();
+}
+
+void traceWrite(struct traceRecord &rec, const vector<string> &strs) {
+    if(traceFile == NULL) return;
+
+    string data;
+    for(const auto& str : strs) {
+        data += str;
+        data += '\0';
+    }
+    rec.length = data.size();
+
+    sem_wait(&traceMutex);
+    fwrite(&rec, sizeof(rec), 1, traceFile);
+    fwrite(data.data(), 1, data.size(), traceFile);
+    sem_post(&traceMutex);
+}
+
+void traceGuest(int guestId, long memSize, const string &guest, const vector<string> &fileArgs) {
+    struct traceRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.op = TRACE_GUEST;
+    rec.guest = guestId;
+    rec.time = nowNs() - traceStart;
+    rec.size = memSize;
+
+    //image name, then the shared files the guest was started with
+    vector<string> strs;
+    strs.push_back(guest);
+    strs.insert(strs.end(), fileArgs.begin(), fileArgs.end());
+    traceWrite(rec, strs);
+}
+
+void traceConsole(int guestId, char op, char data) {
+    if(traceFile == NULL) return;
+
+    struct traceRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.op = op;
+    rec.guest = guestId;
+    rec.time = nowNs() - traceStart;
+    rec.ret = (uint8_t)data;
+    traceWrite(rec, vector<string>());
+}
+
+void traceFileRequest(int guestId, const struct fileRequest &req, const struct fileReply &reply, uint64_t start, uint64_t end) {
+    if(traceFile == NULL) return;
+
+    struct traceRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.op = req.op;
+    rec.guest = guestId;
+    rec.time = start - traceStart;
+    rec.duration = end - start;
+    rec.handle = (uintptr_t)req.file;
+    rec.ptr = req.ptr;
+    rec.size = req.size;
+    rec.n = req.n;
+    rec.ret = reply.ret;
+    rec.retHandle = (uintptr_t)reply.file;
+
+    vector<string> strs;
+    if(req.op == OPEN_FILE) {
+        strs.push_back(req.name);
+        strs.push_back(req.mode);
+    }
+    strs.push_back(req.guestDir);
+    traceWrite(rec, strs);
+}
+
+//guest writes to one file that the flusher has not handed to the file yet, positions count bytes ever queued
+struct writeBehind {
+    int durability;
+    string pending;
+    uint64_t queued;
+    uint64_t flushed;
+    uint64_t synced;
+    uint64_t drainTo;
+    uint64_t syncTo;
+    bool failed;
+};
+
+struct flushJob {
+    FILE *file;
+    string data;
+    uint64_t end;
+    bool sync;
+};
+
+map<FILE *, struct writeBehind> writeBuffers;
+pthread_mutex_t flushLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t flushWork = PTHREAD_COND_INITIALIZER;
+pthread_cond_t flushDone = PTHREAD_COND_INITIALIZER;
+bool flusherRunning = false;
+bool flusherStop = false;
+int defaultDurability = DURABILITY_NONE;
+map<string, int> fileDurability;
+
+//writes whole chunks in the background, a file someone waits on is written out completely
+//files that need fdatasync in the same round share it, however many writes and guests wait on them
+void flusher() {
+    pthread_mutex_lock(&flushLock);
+    for(;;) {
+        vector<struct flushJob> batch;
+        for(auto& entry : writeBuffers) {
+            struct writeBehind &wb = entry.second;
+            bool sync = wb.syncTo > wb.synced;
+            size_t take = wb.pending.size();
+            if(!sync && wb.drainTo <= wb.flushed) take -= take % FLUSH_CHUNK;
+            if(take == 0 && !sync) continue;
+
+            batch.push_back({entry.first, wb.pending.substr(0, take), wb.flushed + take, sync});
+            wb.pending.erase(0, take);
+        }
+
+        if(batch.empty()) {
+            if(flusherStop) break;
+            pthread_cond_wait(&flushWork, &flushLock);
+            continue;
+        }
+        pthread_mutex_unlock(&flushLock);
+
+        vector<bool> ok(batch.size(), true);
+        for(size_t i = 0; i < batch.size(); i++) {
+            const struct flushJob &job = batch[i];
+            if(!job.data.empty()) ok[i] = fwrite(job.data.data(), 1, job.data.size(), job.file) == job.data.size();
+            ok[i] = fflush(job.file) == 0 && ok[i];
+        }
+        for(size_t i = 0; i < batch.size(); i++) {
+            if(batch[i].sync) ok[i] = fdatasync(fileno(batch[i].file)) == 0 && ok[i];
+        }
+
+        pthread_mutex_lock(&flushLock);
+        for(size_t i = 0; i < batch.size(); i++) {
+            struct writeBehind &wb = writeBuffers[batch[i].file];
+            wb.flushed = batch[i].end;
+            if(batch[i].sync) wb.synced = batch[i].end;
+            if(!ok[i]) wb.failed = true;
+        }
+        pthread_cond_broadcast(&flushDone);
+    }
+    pthread_mutex_unlock(&flushLock);
+}
+
+//files are only buffered while the flusher runs, replay writes straight through
+void writeBehindOpen(FILE *file, int durability) {
+    if(!flusherRunning || file == NULL) return;
+    pthread_mutex_lock(&flushLock);
+    writeBuffers[file] = {durability, "", 0, 0, 0, 0, 0, false};
+    pthread_mutex_unlock(&flushLock);
+}
+
+int writeBehindDurability(FILE *file) {
+    pthread_mutex_lock(&flushLock);
+    auto wb = writeBuffers.find(file);
+    int durability = wb == writeBuffers.end() ? DURABILITY_NONE : wb->second.durability;
+    pthread_mutex_unlock(&flushLock);
+    return durability;
+}
+
+size_t writeBehindWrite(FILE *file, const char *data, size_t size, size_t n) {
+    pthread_mutex_lock(&flushLock);
+    auto wb = writeBuffers.find(file);
+    if(wb == writeBuffers.end()) {
+        pthread_mutex_unlock(&flushLock);
+        return fwrite(data, size, n, file);
+    }
+
+    wb->second.pending.append(data, size * n);
+    wb->second.queued += size * n;
+    if(wb->second.pending.size() >= FLUSH_CHUNK) pthread_cond_signal(&flushWork);
+    pthread_mutex_unlock(&flushLock);
+    return n;
+}
+
+//holds the writer back until the flusher caught up to below WRITE_BEHIND_LIMIT
+void writeBehindThrottle(FILE *file) {
+    struct runBlocked blocked;
+    pthread_mutex_lock(&flushLock);
+    auto entry = writeBuffers.find(file);
+    if(entry != writeBuffers.end() && entry->second.queued - entry->second.flushed >= WRITE_BEHIND_LIMIT) {
+        struct writeBehind &wb = entry->second;
+        blocked.begin();
+        pthread_cond_signal(&flushWork);
+        while(wb.queued - wb.flushed >= WRITE_BEHIND_LIMIT) pthread_cond_wait(&flushDone, &flushLock);
+    }
+    pthread_mutex_unlock(&flushLock);
+}
+
+//blocks until everything queued so far is in the file, and on disk if sync, false if a write failed
+bool writeBehindWait(FILE *file, bool sync) {
+    pthread_mutex_lock(&flushLock);
+    auto entry = writeBuffers.find(file);
+    if(entry == writeBuffers.end()) {
+        pthread_mutex_unlock(&flushLock);
+        return true;
+    }
+
+    struct writeBehind &wb = entry->second;
+    uint64_t target = wb.queued;
+    wb.drainTo = max(wb.drainTo, target);
+    if(sync) wb.syncTo = max(wb.syncTo, target);
+    if(wb.flushed < target || (sync && wb.synced < target)) {
+        pthread_cond_signal(&flushWork);
+        while(wb.flushed < target || (sync && wb.synced < target)) pthread_cond_wait(&flushDone, &flushLock);
+    }
+    bool ok = !wb.failed;
+    pthread_mutex_unlock(&flushLock);
+    return ok;
+}
+
+//drains the file before it is closed, with fdatasync unless its durability is none
+bool writeBehindClose(FILE *file) {
+    bool ok = writeBehindWait(file, writeBehindDurability(file) != DURABILITY_NONE);
+    pthread_mutex_lock(&flushLock);
+    writeBuffers.erase(file);
+    pthread_mutex_unlock(&flushLock);
+    return ok;
+}
+
+int closeFile(FILE *file) {
+    bool ok = writeBehindClose(file);
+    int ret = fclose(file);
+    return ok ? ret : EOF;
+}
+
+void stopFlusher(thread &flusherThread) {
+    pthread_mutex_lock(&flushLock);
+    flusherStop = true;
+    pthread_cond_signal(&flushWork);
+    pthread_mutex_unlock(&flushLock);
+    flusherThread.join();
+}
+
+int durabilityFor(const string &name) {
+    auto durability = fileDurability.find(name);
+    return durability == fileDurability.end() ? defaultDurability : durability->second;
+}
+
+void forgetFile(struct fileState &state, FILE *file) {
+    state.fileNames.erase(file);
+    state.modes.erase(file);
+    state.cursors.erase(file);
+    state.fileCopied.erase(file);
+}
+
+//closes whatever the guest left open when it stopped
+void closeFiles(struct fileState &state) {
+    for(const auto& file : state.fileNames) {
+        if(file.first != NULL) closeFile(file.first);
+    }
+    state.fileNames.clear();
+    state.modes.clear();
+    state.cursors.clear();
+    state.fileCopied.clear();
+}
+
+//decodes op#arg#...## as built by the guest library
+//false if the guest sent something malformed, req->op is still set when the op itself was readable
+bool parseFileRequest(const string &operation, struct fileRequest *req) {
+    vector<string> args = split(operation, '#');
+    req->op = args.empty() || args[0].size() != 1 ? 0 : args[0][0];
+    req->ptr = 0;
+    req->size = 0;
+    req->n = 0;
+    req->file = NULL;
+
+    try {
+        if(req->op == OPEN_FILE && args.size() >= 4) {
+            // 0#filename#modes#guestx/##
+            req->name = args[1];
+            req->mode = args[2];
+            req->guestDir = args[3];
+            return true;
+        } else if(req->op == CLOSE_FILE && args.size() >= 3) {
+            // 1#file#guestx/##
+            req->file = reinterpret_cast<FILE *>(strToPtr(args[1]));
+            req->guestDir = args[2];
+            return true;
+        } else if((req->op == READ_FILE || req->op == WRITE_FILE) && args.size() >= 6) {
+            // 2#ptr#size#n#file#guestx/## or 3#ptr#size#n#file#guestx/##
+            req->ptr = strToPtr(args[1]);
+            req->size = stoul(args[2]);
+            req->n = stoul(args[3]);
+            req->file = reinterpret_cast<FILE *>(strToPtr(args[4]));
+            req->guestDir = args[5];
+            return true;
+        }
+    } catch(const logic_error &e) {
+        //stoul and strToPtr throw invalid_argument and out_of_range
+    }
+    req->file = NULL;
+    return false;
+}
+
+//executes one decoded request against the host files, guest is the request's buffer in host memory
+//size * n of a read or write, false when it overflows and so can not be a real buffer
+bool requestBytes(const struct fileRequest &req, uint64_t *bytes) {
+    return !__builtin_mul_overflow(req.size, req.n, bytes);
+}
+
+struct fileReply fileBackend(const vector<struct iovec> &guest, struct fileState &state, const vector<string> &fileArgs, const struct fileRequest &req) {
+    struct fileReply reply = {0, NULL};
+    uint64_t bytes = 0;
+
+    //a buffer the guest can not address fails the whole request
+    if((req.op == READ_FILE || req.op == WRITE_FILE) && (!requestBytes(req, &bytes) || iovLength(guest) != bytes)) {
+        reply.file = req.file;
+        return reply;
+    }
+
+    bool foundFile = false;
+    string fileName = "";
+    if(req.op == OPEN_FILE) {
+        fileName = req.name;
+    } else {
+        //only handles an fopen returned are known, anything else must never reach stdio
+        auto name = state.fileNames.find(req.file);
+        if(req.file == NULL || name == state.fileNames.end()) {
+            if(req.op == CLOSE_FILE) reply.ret = EOF;
+            else reply.file = req.file;
+            return reply;
+        }
+        fileName = name->second;
+    }
+
+    for(int i = 0; i < fileArgs.size(); i++) {
+        if(strcmp(fileArgs[i].c_str(), fileName.c_str()) == 0) {
+            foundFile = true;
+            break;
+        }
+    }
+
+    if(foundFile) {
+        //shared files
+        if(req.op == OPEN_FILE) {
+            FILE* file = fopen(req.name.c_str(), req.mode.c_str());
+            if(file != NULL) {
+                writeBehindOpen(file, durabilityFor(req.name));
+                state.fileNames[file] = req.name;
+                state.modes[file] = req.mode;
+                state.fileCopied[file] = false;
+            }
+            reply.file = file;
+        } else if(req.op == CLOSE_FILE) {
+            reply.ret = closeFile(req.file);
+            forgetFile(state, req.file);
+        } else if(req.op == READ_FILE) {
+            FILE *file = req.file;
+            if(!state.fileCopied[file]) {
+                //reading from shared file, before first write
+                fseek(file, 0, state.cursors[file]);
+            }
+
+            writeBehindWait(file, false);
+            char *buffer = new char[bytes];
+            reply.ret = fread(buffer, req.size, req.n, file);
+            copyToGuest(guest, buffer);
+            delete[] buffer;
+
+            if(!state.fileCopied[file]) {
+                state.cursors[file] = ftell(file);
+            }
+            reply.file = file;
+        } else if(req.op == WRITE_FILE) {
+            FILE *file = req.file;
+            if(!state.fileCopied[file]) {
+                //first write
+                FILE* file2 = fopen((req.guestDir + state.fileNames[file]).c_str(), state.modes[file].c_str());
+                if(file2 == NULL) {
+                    //the shared file stays open, the guest may retry the write
+                    reply.file = file;
+                    return reply;
+                }
+                writeBehindOpen(file2, writeBehindDurability(file));
+                state.fileNames[file2] = req.guestDir + state.fileNames[file];
+                state.modes[file2] = state.modes[file];
+                state.fileCopied[file2] = true;
+
+                //copying file to folder with private files
+                long cursorTemp = state.cursors[file];
+                fseek(file, 0, SEEK_SET);
+                char buffer[10];
+                size_t bytesRead;
+                while((bytesRead = fread(buffer, 1, 10, file)) > 0) {
+                    fwrite(buffer, 1, bytesRead, file2);
+                }
+                fseek(file, 0, cursorTemp);
+                fseek(file2, 0, cursorTemp);
+                closeFile(file);
+                forgetFile(state, file);
+
+                char *buffer2 = new char[bytes];
+                copyFromGuest(buffer2, guest);
+                reply.ret = writeBehindWrite(file2, buffer2, req.size, req.n);
+                delete[] buffer2;
+                reply.file = file2;
+            } else {
+                char *buffer = new char[bytes];
+                copyFromGuest(buffer, guest);
+                reply.ret = writeBehindWrite(file, buffer, req.size, req.n);
+                delete[] buffer;
+                reply.file = file;
+            }
+        }
+    } else {
+        //private files
+        if(req.op == OPEN_FILE) {
+            FILE* file = fopen((req.guestDir + req.name).c_str(), req.mode.c_str());
+            if(file != NULL) {
+                writeBehindOpen(file, durabilityFor(req.name));
+                state.fileNames[file] = req.guestDir + req.name;
+                state.modes[file] = req.mode;
+            }
+            reply.file = file;
+        } else if(req.op == CLOSE_FILE) {
+            reply.ret = closeFile(req.file);
+            forgetFile(state, req.file);
+        } else if(req.op == READ_FILE) {
+            writeBehindWait(req.file, false);
+            char *buffer = new char[bytes];
+            reply.ret = fread(buffer, req.size, req.n, req.file);
+            copyToGuest(guest, buffer);
+            delete[] buffer;
+            reply.file = req.file;
+        } else if(req.op == WRITE_FILE) {
+            char *buffer = new char[bytes];
+            copyFromGuest(buffer, guest);
+            reply.ret = writeBehindWrite(req.file, buffer, req.size, req.n);
+            delete[] buffer;
+            reply.file = req.file;
+        }
+    }
+    return reply;
+}
+
+//a device model, gets the port I/O and MMIO exits of the ranges it was registered for
+struct device {
+    virtual ~device() {}
+    virtual void out(uint16_t port, const char *data, int size) {}
+    virtual void in(uint16_t port, char *data, int size) {}
+    virtual void mmioWrite(uint64_t addr, const char *data, int len) {}
+    virtual void mmioRead(uint64_t addr, char *data, int len) {}
+};
+
+//maps ports and MMIO pages of one guest to devices, both lookups are O(1)
+struct deviceRegistry {
+    //rows of 256 ports, only allocated for rows that have a device
+    struct device **ports[256];
+    unordered_map<uint64_t, struct device *> mmio;
+
+    deviceRegistry() {
+        memset(ports, 0, sizeof(ports));
+    }
+
+    ~deviceRegistry() {
+        for(int i = 0; i < 256; i++) {
+            delete[] ports[i];
+        }
+    }
+
+    void addPorts(uint16_t first, int count, struct device *dev) {
+        for(int port = first; port < first + count && port <= 0xFFFF; port++) {
+            if(ports[port >> 8] == NULL) ports[port >> 8] = new struct device *[256]();
+            ports[port >> 8][port & 0xFF] = dev;
+        }
+    }
+
+    void addMmio(uint64_t addr, uint64_t size, struct device *dev) {
+        for(uint64_t page = addr / GUEST_PAGE_SIZE; page < (addr + size + GUEST_PAGE_SIZE - 1) / GUEST_PAGE_SIZE; page++) {
+            mmio[page] = dev;
+        }
+    }
+
+    struct device *port(uint16_t port) {
+        struct device **row = ports[port >> 8];
+        return row == NULL ? NULL : row[port & 0xFF];
+    }
+
+    struct device *mmioAt(uint64_t addr) {
+        auto it = mmio.find(addr / GUEST_PAGE_SIZE);
+        return it == mmio.end() ? NULL : it->second;
+    }
+};
+
+//string I/O (rep outsb/insb) arrives as count elements in one exit
+//reads from unclaimed ports see all ones like unclaimed MMIO, writes are dropped
+void dispatchIo(struct deviceRegistry &devices, struct kvm_run *kvm_run) {
+    struct device *dev = devices.port(kvm_run->io.port);
+    char *data = (char *)kvm_run + kvm_run->io.data_offset;
+    if(dev == NULL) {
+        if(kvm_run->io.direction == KVM_EXIT_IO_IN) memset(data, 0xFF, (size_t)kvm_run->io.size * kvm_run->io.count);
+        return;
+    }
+
+    for(uint32_t i = 0; i < kvm_run->io.count; i++, data += kvm_run->io.size) {
+        if(kvm_run->io.direction == KVM_EXIT_IO_OUT) dev->out(kvm_run->io.port, data, kvm_run->io.size);
+        else dev->in(kvm_run->io.port, data, kvm_run->io.size);
+    }
+}
+
+//reads from unclaimed MMIO see all ones, writes are dropped
+void dispatchMmio(struct deviceRegistry &devices, struct kvm_run *kvm_run) {
+    struct device *dev = devices.mmioAt(kvm_run->mmio.phys_addr);
+    char *data = (char *)kvm_run->mmio.data;
+    if(dev == NULL) {
+        if(!kvm_run->mmio.is_write) memset(data, 0xFF, kvm_run->mmio.len);
+        return;
+    }
+
+    if(kvm_run->mmio.is_write) dev->mmioWrite(kvm_run->mmio.phys_addr, data, kvm_run->mmio.len);
+    else dev->mmioRead(kvm_run->mmio.phys_addr, data, kvm_run->mmio.len);
+}
+
+//CONSOLE_PORT, bytes to stdout and from stdin
+struct consoleDevice : device {
+    int guestId;
+    struct guestStats *stats;
+    struct tokenBucket bucket;
+
+    consoleDevice(const struct vmArgs &arg, struct guestStats *stats) : guestId(arg.guestId), stats(stats) {
+        initBucket(bucket, arg.limits.console);
+    }
+
+    void out(uint16_t port, const char *data, int size) override {
+        throttle(stats, takeTokens(bucket, 1));
+        stats->consoleBytes++;
+        cout << *data;
+        traceConsole(guestId, TRACE_CONSOLE_OUT, *data);
+    }
+
+    //the guest reads 0 once stdin is closed or its time limit ran out
+    void in(uint16_t port, char *data, int size) override {
+        char c = 0;
+        struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+        struct runBlocked blocked;
+        for(;;) {
+            int timeout = -1;
+            if(deviceDeadline > 0) {
+                uint64_t now = nowNs();
+                if(now >= deviceDeadline) break;
+                timeout = (deviceDeadline - now + 999999) / 1000000;
+            }
+            int ready = poll(&fd, 1, 0);
+            if(ready == 0) {
+                blocked.begin();
+                ready = poll(&fd, 1, timeout);
+            }
+            if(ready < 0 && errno == EINTR) continue;
+            if(ready > 0 && read(STDIN_FILENO, &c, 1) != 1) c = 0;
+            if(ready != 0) break;
+        }
+        *data = c;
+        traceConsole(guestId, TRACE_CONSOLE_IN, c);
+    }
+};
+
+//FILE_PORT, collects op#arg#...## requests and queues the replies the guest reads back
+struct fileDevice : device {
+    struct vm *vm;
+    const struct vmArgs &arg;
+    struct guestStats *stats;
+    string operation;
+    struct fileState state;
+    queue<uint64_t> sendBack;
+    struct tokenBucket opsBucket;
+    struct tokenBucket bytesBucket;
+
+    fileDevice(struct vm *vm, const struct vmArgs &arg, struct guestStats *stats) : vm(vm), arg(arg), stats(stats) {
+        initBucket(opsBucket, arg.limits.ops);
+        initBucket(bytesBucket, arg.limits.bytes);
+    }
+
+    ~fileDevice() {
+        closeFiles(state);
+    }
+
+    void out(uint16_t port, const char *data, int size) override {
+        operation += *data;
+        if(operation.length() < 2 || operation[operation.length() - 1] != '#' || operation[operation.length() - 2] != '#') return;
+
+        struct fileRequest req;
+        bool valid = parseFileRequest(operation, &req);
+        operation = "";
+
+        //only handles this guest opened itself may reach fclose, fread and fwrite
+        if(valid && req.op != OPEN_FILE && (req.file == NULL || state.fileNames.count(req.file) == 0)) valid = false;
+        if(!valid) {
+            cout << "Malformed file request from " << arg.guestArg << endl;
+            struct fileReply reply = {req.op == CLOSE_FILE ? (uint64_t)EOF : 0, NULL};
+            sendReply(req, reply);
+            return;
+        }
+
+        uint64_t bytes = 0;
+        if((req.op == READ_FILE || req.op == WRITE_FILE) && !requestBytes(req, &bytes)) {
+            cout << "Malformed file request from " << arg.guestArg << endl;
+            struct fileReply reply = {0, req.file};
+            sendReply(req, reply);
+            return;
+        }
+
+        //wait off the quota before taking the lock, so only this guest is slowed down
+        throttle(stats, max(takeTokens(opsBucket, 1), takeTokens(bytesBucket, bytes)));
+        stats->fileOps++;
+        if(req.op == READ_FILE) stats->bytesRead += bytes;
+        else if(req.op == WRITE_FILE) stats->bytesWritten += bytes;
+
+        //the guest passes virtual addresses
+        vector<struct iovec> guest;
+        struct kvm_sregs sregs;
+        if(req.op == READ_FILE || req.op == WRITE_FILE) {
+            if(ioctl(vm->vcpu_fd, KVM_GET_SREGS, &sregs) < 0) perror("KVM_GET_SREGS");
+            else if(!guest_buffer(vm, sregs, req.ptr, bytes, req.op == READ_FILE, guest)) guest.clear();
+        }
+
+        sem_wait(&mutex);
+        uint64_t start = nowNs();
+        struct fileReply reply = fileBackend(guest, state, arg.fileArgs, req);
+        if(req.op == READ_FILE) {
+            for(const auto& range : guest) {
+                char *host = (char *)range.iov_base;
+                if(host >= vm->mem && host < vm->mem + vm->mem_size) mark_dirty(vm, host - vm->mem, range.iov_len);
+            }
+        }
+        traceFileRequest(arg.guestId, req, reply, start, nowNs());
+        sem_post(&mutex);
+
+        //waits for the group commit, or for the flusher to catch up, without the lock so other guests keep queueing writes meanwhile
+        //fileBackend also waits for the flusher, but holding the lock it must not queue for a run token
+        if(req.op == WRITE_FILE && reply.ret > 0 && writeBehindDurability(reply.file) == DURABILITY_WRITE) {
+            struct runBlocked blocked;
+            blocked.begin();
+            if(!writeBehindWait(reply.file, true)) reply.ret = 0;
+        } else if(req.op == WRITE_FILE && reply.ret > 0) {
+            writeBehindThrottle(reply.file);
+        }
+
+        sendReply(req, reply);
+    }
+
+    //queues the words the guest library reads back for this op
+    void sendReply(const struct fileRequest &req, const struct fileReply &reply) {
+        if(req.op == OPEN_FILE) {
+            pushFileHandleToQueue(reply.file, sendBack);
+        } else if(req.op == CLOSE_FILE) {
+            sendBack.push(reply.ret);
+        } else if(req.op == READ_FILE || req.op == WRITE_FILE) {
+            sendBack.push(reply.ret);
+            pushFileHandleToQueue(reply.file, sendBack);
+        }
+    }
+
+    void in(uint16_t port, char *data, int size) override {
+        if(!sendBack.empty()) {
+            uint64_t value = sendBack.front();
+            sendBack.pop();
+            memcpy(data, &value, size);
+        }
+    }
+};
+
+//SHM_PORT selects a --shm region and answers with its address and size, DOORBELL_PORT rings and waits
+struct shmDevice : device {
+    uint32_t selected;
+    queue<uint64_t> replies;
+    vector<uint32_t> seen;
+
+    shmDevice() : selected(0), seen(shmRegions.size()) {}
+
+    void out(uint16_t port, const char *data, int size) override {
+        uint32_t index = 0;
+        memcpy(&index, data, min(size, 4));
+        if(port == DOORBELL_PORT) {
+            shmRing(index, seen);
+            return;
+        }
+
+        selected = index;
+        replies = queue<uint64_t>();
+        replies.push(index < shmRegions.size() ? shmRegions[index]->gpa : 0);
+        replies.push(index < shmRegions.size() ? shmRegions[index]->size : 0);
+    }
+
+    void in(uint16_t port, char *data, int size) override {
+        uint64_t value = 0;
+        if(port == DOORBELL_PORT) {
+            value = shmWait(selected, seen);
+        } else if(!replies.empty()) {
+            value = replies.front();
+            replies.pop();
+        }
+        memcpy(data, &value, min(size, 8));
+    }
+};
+
+//the guest reads how many pages the host wants back and reports free ranges as address low, address high, pages
+struct balloonDevice : device {
+    struct vm *vm;
+    struct guestStats *stats;
+    uint64_t wanted;
+    uint32_t words[3];
+    int count;
+
+    balloonDevice(struct vm *vm, const struct vmArgs &arg, struct guestStats *stats) : vm(vm), stats(stats), wanted(arg.balloonPages), count(0) {}
+
+    void out(uint16_t port, const char *data, int size) override {
+        words[count] = 0;
+        memcpy(&words[count], data, min(size, 4));
+        if(++count < 3) return;
+        count = 0;
+
+        uint64_t gva = words[0] | (uint64_t)words[1] << 32;
+        uint64_t len = min((uint64_t)words[2], wanted) * GUEST_PAGE_SIZE;
+        if(gva % GUEST_PAGE_SIZE != 0 || len == 0) return;
+
+        struct kvm_sregs sregs;
+        vector<struct iovec> iov;
+        if(ioctl(vm->vcpu_fd, KVM_GET_SREGS, &sregs) < 0 || !guest_buffer(vm, sregs, gva, len, true, iov)) return;
+
+        //shm regions are shared with other guests and never released
+        for(const auto& range : iov) {
+            char *host = (char *)range.iov_base;
+            if(host < vm->mem || host >= vm->mem + vm->mem_size) continue;
+            //the guest gave up every page of the range, only the resident ones free host memory
+            long reclaimed = release_pages(vm, host - vm->mem, range.iov_len);
+            if(reclaimed < 0) continue;
+            wanted -= min(wanted, (uint64_t)(range.iov_len / GUEST_PAGE_SIZE));
+            stats->reclaimedPages += reclaimed;
+        }
+    }
+
+    void in(uint16_t port, char *data, int size) override {
+        uint32_t value = min(wanted, (uint64_t)UINT32_MAX);
+        memcpy(data, &value, min(size, 4));
+    }
+};
+
+bool printStatsArg = false;
+int profileArg = 0;
+bool lazyArg = false;
+
+//runs the guest until it stops, returns the KVM exit reason it stopped with or -1
+int api(struct vm &vm, const struct vmArgs &arg, struct guestStats *stats) {
+    int stop = 0;
+    int ret = 0;
+    int reason = -1;
+    int guestId = arg.guestId;
+
+    memset(stats, 0, sizeof(*stats));
+    struct profile prof;
+    prof.samples = 0;
+
+    struct deviceRegistry devices;
+    struct consoleDevice console(arg, stats);
+    struct fileDevice files(&vm, arg, stats);
+    struct shmDevice shm;
+    struct balloonDevice balloon(&vm, arg, stats);
+    devices.addPorts(CONSOLE_PORT, 1, &console);
+    devices.addPorts(FILE_PORT, 1, &files);
+    devices.addPorts(DOORBELL_PORT, 1, &shm);
+    devices.addPorts(SHM_PORT, 1, &shm);
+    devices.addPorts(BALLOON_PORT, 1, &balloon);
+
+    bool limited = arg.timeLimitNs > 0 || arg.cpuLimitNs > 0;
+    if(limited) __sync_fetch_and_add(&limitedGuests, 1);
+    uint64_t started = nowNs();
+    uint64_t cpuStarted = threadCpuNs();
+
+    int samplePending = 0;
+    vm.guest_id = guestId;
+    deviceDeadline = arg.timeLimitNs > 0 ? started + arg.timeLimitNs : 0;
+    registerVcpu(guestId, vm.kvm_run, &samplePending);
+    runAcquire();
+
+    while(stop == 0) {
+        if(vm.out_of_memory) {
+            cout << "Out of memory" << endl;
+            break;
+        }
+        //also checked after device exits, which may have given up waiting because of it
+        if(deviceDeadline > 0 && nowNs() >= deviceDeadline) {
+            cout << "Time limit exceeded" << endl;
+            stats->timeLimited = true;
+            break;
+        }
+
+        ret = ioctl(vm.vcpu_fd, KVM_RUN, 0);
+        if(ret == -1 && errno == EINTR) {
+            //kicked by another thread
+            vm.kvm_run->immediate_exit = 0;
+            if(__sync_lock_test_and_set(&samplePending, 0)) sampleGuest(&vm, &prof);
+
+            uint64_t now = nowNs();
+            if(arg.cpuLimitNs > 0 && threadCpuNs() - cpuStarted >= arg.cpuLimitNs) {
+                cout << "CPU time limit exceeded" << endl;
+                stats->cpuLimited = true;
+                break;
+            }
+            //the slice is over and someone waits, go to the back of the queue
+            if(now - runSliceStart >= sliceNs && runWaiting()) {
+                stats->preempted++;
+                runRelease();
+                runAcquire();
+            }
+            continue;
+        }
+        if(ret == -1) {
+            cout << "KVM_RUN failed" << endl;
+            break;
+        }
+
+        switch(vm.kvm_run->exit_reason) {
+            //devices keep the run token, the ones that may block hand it on with runBlocked
+            case KVM_EXIT_IO:
+                dispatchIo(devices, vm.kvm_run);
+                continue;
+            case KVM_EXIT_MMIO:
+                dispatchMmio(devices, vm.kvm_run);
+                continue;
+            case KVM_EXIT_HLT:
+                cout << "KVM_EXIT_HLT" << endl;
+                stop = 1;
+                break;
+            case KVM_EXIT_INTERNAL_ERROR:
+                cout << "Internal error: suberror = 0x" << hex << vm.kvm_run->internal.suberror << endl;
+                stop = 1;
+                break;
+            case KVM_EXIT_SHUTDOWN:
+                cout << "Shutdown" << endl;
+                stop = 1;
+                break;
+            default:
+                cout << "Exit reason: " << vm.kvm_run->exit_reason << endl;
+                break;
+        }
+        if(stop) reason = vm.kvm_run->exit_reason;
+    }
+
+    runRelease();
+    unregisterVcpu(guestId);
+    deviceDeadline = 0;
+    if(limited) __sync_fetch_and_sub(&limitedGuests, 1);
+    stats->runNs = nowNs() - started;
+    stats->cpuNs = threadCpuNs() - cpuStarted;
+    stats->residentPages = vm.resident;
+    if(profileArg > 0) writeProfile(arg.guestArg, prof);
+    return reason;
+}
+
+struct replayStats {
+    uint64_t count;
+    uint64_t bytes = 0;
+    uint64_t recordedNs;
+    uint64_t replayNs;
+};
+
+struct replayGuest {
+    vector<char> mem;
     vector<string> fileArgs;
-    if(!parseArgs(argc, argv, &memoryArg, &pageArg, guestArgs, fileArgs)) {
-        cout << "Run program like this ./mini_hypervisor [--memory or -m] [2, 4 or 8] [--page or -p] [2 or 4] [--guest or -g] guest1/guest1.img guest2/guest2.img [--file or -f] lorem1.txt lorem2.txt" << endl;
+    struct fileState state;
+    map<uint64_t, FILE *> handles;
+};
+
+//how many strings a record carries, as written by traceGuest, traceConsole and traceFileRequest, -1 for unknown ops
+int replayStrings(char op) {
+    if(op == TRACE_GUEST) return 1;
+    if(op == TRACE_CONSOLE_OUT || op == TRACE_CONSOLE_IN) return 0;
+    if(op == OPEN_FILE) return 3;
+    if(op == CLOSE_FILE || op == READ_FILE || op == WRITE_FILE) return 1;
+    return -1;
+}
+
+//paths from a trace have to stay inside the replay directory, also once fileBackend glued two of them together
+bool replayPathSafe(const string &path) {
+    if(path.empty() || path[0] == '/') return false;
+    for(const auto& part : split(path, '/')) {
+        if(part == ".." || part == ".") return false;
+    }
+    return true;
+}
+
+//a shared file the guests read is copied in from where the hypervisor was started, once
+void replayCopyInput(const string &origin, const string &name) {
+    if(access(name.c_str(), F_OK) == 0) return;
+    ifstream in(origin + "/" + name, ios::binary);
+    if(!in.is_open()) return;
+    ofstream out(name, ios::binary);
+    out << in.rdbuf();
+}
+
+//drives fileBackend from a trace recorded with --trace, without KVM
+//every file is opened inside dir, so replaying never touches the files the trace was recorded on
+int replayTrace(const string &path, bool originalTiming, const string &dir) {
+    FILE *trace = fopen(path.c_str(), "rb");
+    if(trace == NULL) {
+        perror("open trace");
+        return 1;
+    }
+
+    char magic[8];
+    if(fread(magic, 1, sizeof(magic), trace) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        cout << "Not a hypervisor trace: " << path << endl;
+        fclose(trace);
+        return 1;
+    }
+
+    char cwd[4096];
+    if(getcwd(cwd, sizeof(cwd)) == NULL || (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) || chdir(dir.c_str()) < 0) {
+        perror("replay directory");
+        fclose(trace);
+        return 1;
+    }
+    string origin = cwd;
+
+    map<uint16_t, struct replayGuest> guests;
+    map<char, struct replayStats> stats;
+    struct traceRecord rec;
+    uint64_t start = nowNs();
+
+    while(fread(&rec, sizeof(rec), 1, trace) == 1) {
+        vector<char> data(rec.length);
+        if(rec.length > 0 && fread(data.data(), 1, rec.length, trace) != rec.length) break;
+        vector<string> strs;
+        if(!data.empty() && data.back() == '\0') {
+            for(size_t i = 0; i < data.size(); i += strs.back().size() + 1) {
+                strs.emplace_back(data.data() + i);
+            }
+        }
+        int needed = replayStrings(rec.op);
+        if(needed < 0 || (!data.empty() && data.back() != '\0') || strs.size() < (size_t)needed) {
+            cout << "Skipping malformed trace record" << endl;
+            continue;
+        }
+        bool safe = true;
+        for(size_t i = 0; i < strs.size(); i++) {
+            //the guest image and the open mode are never opened as paths
+            if((rec.op == TRACE_GUEST && i == 0) || (rec.op == OPEN_FILE && i == 1)) continue;
+            safe = safe && replayPathSafe(strs[i]);
+        }
+        if(!safe) {
+            cout << "Skipping trace record with a path outside the replay directory" << endl;
+            continue;
+        }
+
+        if(originalTiming) {
+            uint64_t now = nowNs() - start;
+            if(rec.time > now) sleepNs(rec.time - now);
+        }
+
+        struct replayGuest &guest = guests[rec.guest];
+        struct replayStats &stat = stats[rec.op];
+        stat.count++;
+
+        if(rec.op == TRACE_GUEST) {
+            guest.mem.assign(min((uint64_t)rec.size, (uint64_t)MAX_MEMORY_MB * 1024 * 1024), 0);
+            guest.fileArgs.assign(strs.begin() + 1, strs.end());
+            for(const auto& fileArg : guest.fileArgs) replayCopyInput(origin, fileArg);
+            continue;
+        }
+        if(rec.op == TRACE_CONSOLE_OUT || rec.op == TRACE_CONSOLE_IN) {
+            stat.bytes++;
+            continue;
+        }
+
+        struct fileRequest req;
+        req.op = rec.op;
+        req.ptr = rec.ptr;
+        req.size = rec.size;
+        req.n = rec.n;
+        req.file = NULL;
+        //fileBackend opens guestDir + name, and on the first write to a shared file guestDir + its name
+        string opened;
+        if(req.op == OPEN_FILE) {
+            req.name = strs[0];
+            req.mode = strs[1];
+            req.guestDir = strs[2];
+            opened = req.guestDir + req.name;
+        } else {
+            req.guestDir = strs[0];
+            if(guest.handles.count(rec.handle) == 0 || guest.handles[rec.handle] == NULL) {
+                cout << "Skipping request on a file that failed to open during replay" << endl;
+                continue;
+            }
+            req.file = guest.handles[rec.handle];
+            if(req.op == WRITE_FILE) opened = req.guestDir + guest.state.fileNames[req.file];
+        }
+        if((!opened.empty() && !replayPathSafe(opened)) || req.guestDir.back() != '/') {
+            cout << "Skipping trace record with a path outside the replay directory" << endl;
+            continue;
+        }
+        if(req.op == OPEN_FILE) mkdir(req.guestDir.c_str(), 0755);
+        uint64_t bytes = 0;
+        if((req.op == READ_FILE || req.op == WRITE_FILE) && (!requestBytes(req, &bytes) || req.ptr > guest.mem.size() || bytes > guest.mem.size() - req.ptr)) {
+            cout << "Skipping request outside of guest memory" << endl;
+            continue;
+        }
+
+        //trace pointers are replayed as offsets into a flat copy of guest memory
+        vector<struct iovec> buffer;
+        if(req.op == READ_FILE || req.op == WRITE_FILE) buffer.push_back({guest.mem.data() + req.ptr, bytes});
+
+        uint64_t opStart = nowNs();
+        struct fileReply reply = fileBackend(buffer, guest.state, guest.fileArgs, req);
+        stat.replayNs += nowNs() - opStart;
+        stat.recordedNs += rec.duration;
+        stat.bytes += reply.ret * req.size;
+
+        if(req.op == CLOSE_FILE) guest.handles.erase(rec.handle);
+        else guest.handles[rec.retHandle] = reply.file;
+    }
+    fclose(trace);
+
+    uint64_t elapsed = nowNs() - start;
+    const pair<char, const char *> names[] = {
+        {OPEN_FILE, "open"}, {CLOSE_FILE, "close"}, {READ_FILE, "read"}, {WRITE_FILE, "write"},
+        {TRACE_CONSOLE_OUT, "console out"}, {TRACE_CONSOLE_IN, "console in"}
+    };
+    cout << "Replayed " << guests.size() << " guests in " << elapsed / 1000 << " us" << endl;
+    for(const auto& name : names) {
+        if(stats.count(name.first) == 0) continue;
+        struct replayStats &stat = stats[name.first];
+        cout << name.second << ": " << stat.count << " ops, " << stat.bytes << " bytes";
+        if(name.first != TRACE_CONSOLE_OUT && name.first != TRACE_CONSOLE_IN) {
+            cout << ", recorded " << stat.recordedNs / stat.count << " ns/op, replayed " << stat.replayNs / stat.count << " ns/op";
+        }
+        cout << endl;
+    }
+    return 0;
+}
+
+long memoryToBytes(int memoryArg) {
+    return (long)memoryArg * 1024 * 1024;
+}
+
+long pageToBytes(int pageArg) {
+    if(pageArg == 2) return 2 * 1024 * 1024;
+    return 4 * 1024;
+}
+
+//long mode, the stack below the page tables and clean FPU/vector state, as a fresh guest expects
+int reset_cpu(struct vm *vm) {
+    struct kvm_sregs sregs = vm->initial_sregs;
+    struct kvm_regs regs;
+    struct kvm_fpu fpu;
+
+    setup_long_mode(vm, &sregs);
+    memset(&vm->tlb, 0, sizeof(vm->tlb));
+
+    if(ioctl(vm->vcpu_fd, KVM_SET_SREGS, &sregs) < 0) {
+        perror("KVM_SET_SREGS");
+        return -1;
+    }
+
+    memset(&regs, 0, sizeof(regs));
+    regs.rflags = 2;
+    regs.rip = 0;
+    //as if _start had been called, so the stack keeps the 16 byte alignment SSE spills rely on
+    regs.rsp = vm->mem_size - page_tables_size(vm) - 8;
+
+    if(ioctl(vm->vcpu_fd, KVM_SET_REGS, &regs) < 0) {
+        perror("KVM_SET_REGS");
+        return -1;
+    }
+
+    if(vm->xcr0 != 0) {
+        struct kvm_xcrs xcrs;
+        memset(&xcrs, 0, sizeof(xcrs));
+        xcrs.nr_xcrs = 1;
+        xcrs.xcrs[0].xcr = 0;
+        xcrs.xcrs[0].value = vm->xcr0;
+        if(ioctl(vm->vcpu_fd, KVM_SET_XCRS, &xcrs) < 0) {
+            perror("KVM_SET_XCRS");
+            return -1;
+        }
+
+        //x87 and SSE from the legacy area, everything above them in init state
+        struct kvm_xsave xsave;
+        memset(&xsave, 0, sizeof(xsave));
+        xsave.region[0] = 0x37f;
+        xsave.region[6] = 0x1f80;
+        xsave.region[128] = XCR0_X87 | XCR0_SSE;
+        if(ioctl(vm->vcpu_fd, KVM_SET_XSAVE, &xsave) < 0) {
+            perror("KVM_SET_XSAVE");
+            return -1;
+        }
+    } else {
+        memset(&fpu, 0, sizeof(fpu));
+        fpu.fcw = 0x37f;
+        fpu.mxcsr = 0x1f80;
+        if(ioctl(vm->vcpu_fd, KVM_SET_FPU, &fpu) < 0) {
+            perror("KVM_SET_FPU");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//runs pxor and hlt once, some KVM implementations fail to emulate any guest SSE instruction
+bool probe_sse() {
+    struct vm vm;
+    bool works = false;
+    if(init_vm(&vm, memoryToBytes(2), pageToBytes(4), false, false) == 0 && reset_cpu(&vm) == 0) {
+        const unsigned char code[] = {0x66, 0x0f, 0xef, 0xc0, 0xf4};
+        memcpy(vm.mem, code, sizeof(code));
+        works = ioctl(vm.vcpu_fd, KVM_RUN, 0) == 0 && vm.kvm_run->exit_reason == KVM_EXIT_HLT;
+    }
+    destroy_vm(&vm);
+    return works;
+}
+
+//puts a created or reset VM into its initial long mode state and loads the guest image
+int load_guest(struct vm *vm, const string &guestArg) {
+    ifstream img;
+
+    img.open(guestArg, ios::binary);
+    if(!img.is_open()) {
+        cout << "Can not open binary file" << endl;
+        return -1;
+    }
+
+    //a lazy VM keeps the image aside and the pager copies in only the pages the guest touches
+    if(vm->lazy) {
+        vm->image.assign(istreambuf_iterator<char>(img), istreambuf_iterator<char>());
+        if((long)vm->image.size() > vm->mem_size) vm->image.resize(vm->mem_size);
+    }
+
+    if(reset_cpu(vm) < 0) return -1;
+
+    char *p = vm->mem;
+    while(!vm->lazy && !img.eof() && p < vm->mem + vm->mem_size) {
+        img.read(p, min(1024L, (long)(vm->mem + vm->mem_size - p)));
+        p += img.gcount();
+    }
+    img.close();
+    mark_dirty(vm, 0, p - vm->mem);
+
+    return 0;
+}
+
+
+//per guest arguments, --io-limit for that guest overrides the default one
+struct vmArgs makeVmArgs(const struct cmdArgs &args, const string &guestArg, int guestId) {
+    struct vmArgs vmArgs;
+    vmArgs.guestArg = guestArg;
+    vmArgs.guestId = guestId;
+    vmArgs.memoryArg = args.memoryArg;
+    vmArgs.pageArg = args.pageArg;
+    vmArgs.fileArgs = args.fileArgs;
+    vmArgs.limits = args.limits;
+    vmArgs.balloonPages = args.balloonPages;
+    vmArgs.timeLimitNs = args.timeLimitNs;
+    vmArgs.cpuLimitNs = args.cpuLimitNs;
+    if(args.guestLimits.count(guestArg)) vmArgs.limits = args.guestLimits.at(guestArg);
+    return vmArgs;
+}
+
+void vmRunner(struct vmArgs arg) {
+    struct vm vm;
+    long memorySize = memoryToBytes(arg.memoryArg);
+
+    if(init_vm(&vm, memorySize, pageToBytes(arg.pageArg), false, lazyArg)) {
+        cout << "Failed to init the VM" << endl;
+        destroy_vm(&vm);
+        shmDetach();
+        return;
+    }
+
+    if(load_guest(&vm, arg.guestArg) == 0) {
+        struct guestStats stats;
+        traceGuest(arg.guestId, memorySize, arg.guestArg, arg.fileArgs);
+        api(vm, arg, &stats);
+        if(printStatsArg) cout << arg.guestArg << ": " + formatStats(stats) + "\n";
+    }
+
+    destroy_vm(&vm);
+    shmDetach();
+}
+
+map<pair<long, long>, vector<struct vm *>> vmPool;
+queue<struct job> jobs;
+int poolLimit;
+bool daemonStopping = false;
+//images with a job running, a second job for one of them waits since both would share its files
+set<string> runningImages;
+pthread_mutex_t imagesLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t imageDone = PTHREAD_COND_INITIALIZER;
+
+//hands out an idle VM with the requested geometry, creating one if the pool has none
+struct vm *poolGet(long memorySize, long pageSize, bool *reused) {
+    sem_wait(&poolMutex);
+    vector<struct vm *> &idle = vmPool[make_pair(memorySize, pageSize)];
+    struct vm *vm = NULL;
+    if(!idle.empty()) {
+        vm = idle.back();
+        idle.pop_back();
+    }
+    sem_post(&poolMutex);
+
+    *reused = vm != NULL;
+    if(vm != NULL) return vm;
+
+    vm = new struct vm;
+    if(init_vm(vm, memorySize, pageSize, true, lazyArg)) {
+        destroy_vm(vm);
+        delete vm;
+        return NULL;
+    }
+    return vm;
+}
+
+void poolPut(struct vm *vm, bool reusable) {
+    if(reusable) {
+        sem_wait(&poolMutex);
+        vector<struct vm *> &idle = vmPool[make_pair(vm->mem_size, vm->page_size)];
+        if(idle.size() < (size_t)poolLimit) {
+            idle.push_back(vm);
+            vm = NULL;
+        }
+        sem_post(&poolMutex);
+    }
+
+    if(vm != NULL) {
+        destroy_vm(vm);
+        delete vm;
+    }
+}
+
+void poolDestroy() {
+    sem_wait(&poolMutex);
+    for(auto& idle : vmPool) {
+        for(struct vm *vm : idle.second) {
+            destroy_vm(vm);
+            delete vm;
+        }
+    }
+    vmPool.clear();
+    sem_post(&poolMutex);
+}
+
+void sendToClient(struct connection *conn, const string &str) {
+    sem_wait(&conn->writeMutex);
+    size_t sent = 0;
+    while(sent < str.size()) {
+        ssize_t n = send(conn->fd, str.data() + sent, str.size() - sent, MSG_NOSIGNAL);
+        if(n <= 0) break;
+        sent += n;
+    }
+    sem_post(&conn->writeMutex);
+}
+
+//the same image reached through another path still shares its files
+string imageKey(const string &guestArg) {
+    char *real = realpath(guestArg.c_str(), NULL);
+    if(real == NULL) return guestArg;
+    string key = real;
+    free(real);
+    return key;
+}
+
+void imageAcquire(const string &key) {
+    pthread_mutex_lock(&imagesLock);
+    while(runningImages.count(key)) pthread_cond_wait(&imageDone, &imagesLock);
+    runningImages.insert(key);
+    pthread_mutex_unlock(&imagesLock);
+}
+
+void imageRelease(const string &key) {
+    pthread_mutex_lock(&imagesLock);
+    runningImages.erase(key);
+    pthread_cond_broadcast(&imageDone);
+    pthread_mutex_unlock(&imagesLock);
+}
+
+void runImageJob(struct job &job) {
+    uint64_t start = nowNs();
+    long memorySize = memoryToBytes(job.vm.memoryArg);
+    bool reused;
+    long cleared = 0;
+    ostringstream result;
+    result << "job " << job.vm.guestId << " " << job.vm.guestArg << ": ";
+
+    struct vm *vm = poolGet(memorySize, pageToBytes(job.vm.pageArg), &reused);
+    if(vm == NULL) {
+        result << "failed to init the VM" << endl;
+        sendToClient(job.conn.get(), result.str());
+        return;
+    }
+
+    if(reused) cleared = reset_vm(vm);
+    if(cleared < 0 || load_guest(vm, job.vm.guestArg) < 0) {
+        poolPut(vm, false);
+        result << "failed to load the guest" << endl;
+        sendToClient(job.conn.get(), result.str());
+        return;
+    }
+
+    uint64_t ready = nowNs();
+    struct guestStats stats;
+    traceGuest(job.vm.guestId, memorySize, job.vm.guestArg, job.vm.fileArgs);
+    shmAttach(1);
+    int reason = api(*vm, job.vm, &stats);
+    shmDetach();
+    uint64_t end = nowNs();
+
+    bool oom = vm->out_of_memory;
+    //only a guest that halted cleanly leaves the VM in a state worth reusing
+    poolPut(vm, reason == KVM_EXIT_HLT);
+
+    if(reason == KVM_EXIT_HLT) result << "hlt";
+    else if(reason == KVM_EXIT_SHUTDOWN) result << "shutdown";
+    else if(reason == KVM_EXIT_INTERNAL_ERROR) result << "internal error";
+    else if(oom) result << "out of memory";
+    else if(stats.timeLimited) result << "time limit exceeded";
+    else if(stats.cpuLimited) result << "CPU time limit exceeded";
+    else result << "KVM_RUN failed";
+    result << ", startup " << (ready - start) / 1000 << " us, run " << (end - ready) / 1000 << " us, ";
+    if(reused) result << "reused VM, cleared " << cleared << " pages";
+    else result << "new VM";
+    if(printStatsArg) result << ", " << formatStats(stats);
+    result << endl;
+    sendToClient(job.conn.get(), result.str());
+}
+
+void runJob(struct job &job) {
+    string image = imageKey(job.vm.guestArg);
+    imageAcquire(image);
+    runImageJob(job);
+    imageRelease(image);
+}
+
+void daemonWorker() {
+    for(;;) {
+        sem_wait(&jobsAvailable);
+        sem_wait(&jobsMutex);
+        struct job job = jobs.front();
+        jobs.pop();
+        sem_post(&jobsMutex);
+
+        //a job without connection tells the worker to exit
+        if(job.conn == NULL) return;
+        runJob(job);
+    }
+}
+
+void pushJob(const struct job &job) {
+    sem_wait(&jobsMutex);
+    jobs.push(job);
+    sem_post(&jobsMutex);
+    sem_post(&jobsAvailable);
+}
+
+bool parseArgs(int argc, char *argv[], struct cmdArgs *args);
+
+//options that only shape one guest, everything else stays as the daemon was started
+bool jobOption(const string &token) {
+    static const set<string> allowed = {"-m", "--memory", "-p", "--page", "-g", "--guest", "-f", "--file", "--io-limit", "--balloon", "--time-limit", "--cpu-limit"};
+    return allowed.count(token) > 0;
+}
+
+//reads job lines "[-m 4] [-p 2] -g guest.img ... [-f file ...]" or "shutdown" from one client,
+//jobs for an image that is already running wait for it to finish
+void daemonReader(shared_ptr<struct connection> conn, struct cmdArgs defaults, int listenFd) {
+    static int nextJobId = 0;
+    string buffer;
+    char chunk[512];
+    ssize_t n;
+
+    while((n = recv(conn->fd, chunk, sizeof(chunk), 0)) > 0) {
+        buffer.append(chunk, n);
+        size_t newline;
+        while((newline = buffer.find('\n')) != string::npos) {
+            string line = buffer.substr(0, newline);
+            buffer.erase(0, newline + 1);
+
+            if(line == "shutdown") {
+                daemonStopping = true;
+                shutdown(listenFd, SHUT_RDWR);
+                sendToClient(conn.get(), "shutting down\n");
+                return;
+            }
+
+            vector<string> tokens;
+            vector<char *> argv;
+            argv.push_back((char *)"job");
+            for(const auto& token : split(line, ' ')) {
+                if(!token.empty()) tokens.push_back(token);
+            }
+            string rejected;
+            for(auto& token : tokens) {
+                if(token[0] == '-' && !jobOption(token) && rejected.empty()) rejected = token;
+                argv.push_back(&token[0]);
+            }
+
+            struct cmdArgs args = defaults;
+            args.guestArgs.clear();
+            args.fileArgs.clear();
+            if(tokens.empty()) continue;
+            if(!rejected.empty()) {
+                sendToClient(conn.get(), "bad job: " + rejected + " can only be set when the daemon starts\n");
+                continue;
+            }
+            if(!parseArgs(argv.size(), argv.data(), &args) || args.guestArgs.empty() || args.memoryArg == 0 || args.pageArg == 0) {
+                sendToClient(conn.get(), "bad job: " + line + "\n");
+                continue;
+            }
+
+            for(const auto& guestArg : args.guestArgs) {
+                struct job job;
+                job.vm = makeVmArgs(args, guestArg, __sync_fetch_and_add(&nextJobId, 1));
+                job.conn = conn;
+                pushJob(job);
+            }
+        }
+    }
+}
+
+//serves guest jobs on a Unix socket, reusing VMs between jobs
+int runDaemon(const struct cmdArgs &args) {
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenFd < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, args.daemonArg.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(addr.sun_path);
+    if(bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, 16) < 0) {
+        perror("bind");
+        close(listenFd);
+        return 1;
+    }
+
+    poolLimit = args.poolArg;
+    vector<thread> workers;
+    for(int i = 0; i < args.workersArg; i++) {
+        workers.emplace_back(daemonWorker);
+    }
+
+    cout << "Waiting for jobs on " << args.daemonArg << endl;
+    while(!daemonStopping) {
+        int fd = accept(listenFd, NULL, NULL);
+        if(fd < 0) break;
+        thread(daemonReader, make_shared<struct connection>(fd), args, listenFd).detach();
+    }
+
+    //queued jobs still run before the workers see their stop jobs
+    struct job stop;
+    for(size_t i = 0; i < workers.size(); i++) {
+        pushJob(stop);
+    }
+    for(auto& worker : workers) {
+        worker.join();
+    }
+
+    poolDestroy();
+    close(listenFd);
+    unlink(args.daemonArg.c_str());
+    return 0;
+}
+
+void printUsage() {
+    cout << "Run program like this ./mini_hypervisor [--memory or -m] [even MB from 2 to 512] [--page or -p] [2 or 4] [--guest or -g] guest1/guest1.img guest2/guest2.img [--file or -f] lorem1.txt lorem2.txt [--trace trace.bin]" << endl;
+    cout << "or replay a trace without KVM like this ./mini_hypervisor --replay trace.bin --replay-dir scratch/ [--timing fast or original]" << endl;
+    cout << "options for guests: [--io-limit [guest.img:]ops=100,bytes=64K,console=1K] [--shm name:2M] [--profile 1000] [--stats] [--lazy [--mem-limit 64M]] [--balloon 1M] [--durability [file.txt:]none, close or write]" << endl;
+    cout << "scheduling: [--time-limit 5] [--cpu-limit 2.5] in seconds, [--max-running 2] guests inside KVM_RUN at once, [--slice 10] in ms" << endl;
+    cout << "or serve guest jobs like this ./mini_hypervisor --daemon hypervisor.sock [--memory or -m] [2 to 512] [--page or -p] [2 or 4] [--workers 4] [--pool 8]" << endl;
+}
+
+//parses 100, 64K or 2M
+bool parseNumber(const string &str, double *value) {
+    char *end;
+    *value = strtod(str.c_str(), &end);
+    if(end == str.c_str()) return false;
+    if(*end == 'K' || *end == 'k') *value *= 1024, end++;
+    else if(*end == 'M' || *end == 'm') *value *= 1024 * 1024, end++;
+    return *end == '\0' && *value >= 0;
+}
+
+bool parseDurability(const string &str, int *durability) {
+    if(str == "none") *durability = DURABILITY_NONE;
+    else if(str == "close") *durability = DURABILITY_CLOSE;
+    else if(str == "write") *durability = DURABILITY_WRITE;
+    else return false;
+    return true;
+}
+
+//parses ops=100,bytes=64K,console=1K
+bool parseLimits(const string &str, struct ioLimits *limits) {
+    for(const auto& item : split(str, ',')) {
+        size_t eq = item.find('=');
+        if(eq == string::npos) return false;
+        string key = item.substr(0, eq);
+        double value;
+        if(!parseNumber(item.substr(eq + 1), &value)) return false;
+
+        if(key == "ops") limits->ops = value;
+        else if(key == "bytes") limits->bytes = value;
+        else if(key == "console") limits->console = value;
+        else return false;
+    }
+    return true;
+}
+
+bool parseArgs(int argc, char *argv[], struct cmdArgs *args) {
+    for(int i = 1; i < argc; ) {
+        if(strcmp(argv[i], "--memory") == 0 || strcmp(argv[i], "-m") == 0)  {
+            if(i + 1 >= argc) return false;
+            int memory = atoi(argv[i + 1]);
+            if(memory < 2 || memory > MAX_MEMORY_MB || memory % 2 != 0) return false;
+            args->memoryArg = memory;
+            i += 2;
+        } else if(strcmp(argv[i], "--page") == 0 || strcmp(argv[i], "-p") == 0) {
+            if(i + 1 >= argc) return false;
+            if(strcmp(argv[i + 1], "2") && strcmp(argv[i + 1], "4")) return false;
+            args->pageArg = atoi(argv[i + 1]);
+            i += 2;
+        } else if(strcmp(argv[i], "--guest") == 0 || strcmp(argv[i], "-g") == 0) {
+            i++;
+            while(i < argc && argv[i][0] != '-') {
+                args->guestArgs.emplace_back(argv[i]);
+                i++;
+            }
+        } else if(strcmp(argv[i], "--file") == 0 || strcmp(argv[i], "-f") == 0) {
+            i++;
+            while(i < argc && argv[i][0] != '-') {
+                args->fileArgs.emplace_back(argv[i]);
+                i++;
+            }
+        } else if(strcmp(argv[i], "--trace") == 0) {
+            if(i + 1 >= argc) return false;
+            args->traceArg = argv[i + 1];
+            i += 2;
+        } else if(strcmp(argv[i], "--replay") == 0) {
+            if(i + 1 >= argc) return false;
+            args->replayArg = argv[i + 1];
+            i += 2;
+        } else if(strcmp(argv[i], "--replay-dir") == 0) {
+            if(i + 1 >= argc) return false;
+            args->replayDirArg = argv[i + 1];
+            i += 2;
+        } else if(strcmp(argv[i], "--timing") == 0) {
+            if(i + 1 >= argc) return false;
+            if(strcmp(argv[i + 1], "fast") && strcmp(argv[i + 1], "original")) return false;
+            args->replayTiming = strcmp(argv[i + 1], "original") == 0;
+            i += 2;
+        } else if(strcmp(argv[i], "--io-limit") == 0) {
+            if(i + 1 >= argc) return false;
+            string value = argv[i + 1];
+            size_t colon = value.rfind(':');
+            struct ioLimits limits = {0, 0, 0};
+            if(!parseLimits(value.substr(colon == string::npos ? 0 : colon + 1), &limits)) return false;
+            if(colon == string::npos) args->limits = limits;
+            else args->guestLimits[value.substr(0, colon)] = limits;
+            i += 2;
+        } else if(strcmp(argv[i], "--shm") == 0) {
+            if(i + 1 >= argc) return false;
+            string value = argv[i + 1];
+            size_t colon = value.find(':');
+            double size;
+            if(colon == string::npos || colon == 0 || !parseNumber(value.substr(colon + 1), &size) || size == 0) return false;
+            args->shmArgs.emplace_back(value.substr(0, colon), (uint64_t)size);
+            i += 2;
+        } else if(strcmp(argv[i], "--profile") == 0) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) <= 0 || atoi(argv[i + 1]) > 100000) return false;
+            args->profileArg = atoi(argv[i + 1]);
+            i += 2;
+        } else if(strcmp(argv[i], "--stats") == 0) {
+            args->stats = true;
+            i++;
+        } else if(strcmp(argv[i], "--lazy") == 0) {
+            args->lazy = true;
+            i++;
+        } else if(strcmp(argv[i], "--mem-limit") == 0) {
+            double limit;
+            if(i + 1 >= argc || !parseNumber(argv[i + 1], &limit) || limit < GUEST_PAGE_SIZE) return false;
+            args->memLimit = (uint64_t)limit;
+            i += 2;
+        } else if(strcmp(argv[i], "--time-limit") == 0 || strcmp(argv[i], "--cpu-limit") == 0) {
+            char *end;
+            double seconds = i + 1 < argc ? strtod(argv[i + 1], &end) : 0;
+            if(i + 1 >= argc || end == argv[i + 1] || *end != '\0' || seconds <= 0) return false;
+            if(strcmp(argv[i], "--time-limit") == 0) args->timeLimitNs = (uint64_t)(seconds * 1e9);
+            else args->cpuLimitNs = (uint64_t)(seconds * 1e9);
+            i += 2;
+        } else if(strcmp(argv[i], "--max-running") == 0) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) <= 0) return false;
+            args->maxRunning = atoi(argv[i + 1]);
+            i += 2;
+        } else if(strcmp(argv[i], "--slice") == 0) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) <= 0) return false;
+            args->sliceMs = atoi(argv[i + 1]);
+            i += 2;
+        } else if(strcmp(argv[i], "--durability") == 0) {
+            if(i + 1 >= argc) return false;
+            string value = argv[i + 1];
+            size_t colon = value.rfind(':');
+            int durability;
+            if(!parseDurability(value.substr(colon == string::npos ? 0 : colon + 1), &durability)) return false;
+            if(colon == string::npos) args->durability = durability;
+            else args->fileDurability[value.substr(0, colon)] = durability;
+            i += 2;
+        } else if(strcmp(argv[i], "--balloon") == 0) {
+            double size;
+            if(i + 1 >= argc || !parseNumber(argv[i + 1], &size)) return false;
+            args->balloonPages = (uint64_t)size / GUEST_PAGE_SIZE;
+            i += 2;
+        } else if(strcmp(argv[i], "--daemon") == 0) {
+            if(i + 1 >= argc) return false;
+            args->daemonArg = argv[i + 1];
+            i += 2;
+        } else if(strcmp(argv[i], "--workers") == 0) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) <= 0) return false;
+            args->workersArg = atoi(argv[i + 1]);
+            i += 2;
+        } else if(strcmp(argv[i], "--pool") == 0) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) < 0) return false;
+            args->poolArg = atoi(argv[i + 1]);
+            i += 2;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    struct cmdArgs args;
+    args.memoryArg = 0;
+    args.pageArg = 0;
+    args.replayTiming = false;
+    args.workersArg = thread::hardware_concurrency() > 0 ? thread::hardware_concurrency() : 1;
+    args.poolArg = 8;
+    args.limits.ops = 0;
+    args.limits.bytes = 0;
+    args.limits.console = 0;
+    args.stats = false;
+    args.profileArg = 0;
+    args.lazy = false;
+    args.memLimit = 0;
+    args.balloonPages = 0;
+    args.durability = DURABILITY_NONE;
+    args.timeLimitNs = 0;
+    args.cpuLimitNs = 0;
+    args.maxRunning = 0;
+    args.sliceMs = 10;
+    if(!parseArgs(argc, argv, &args) || (args.memLimit > 0 && !args.lazy)) {
+        printUsage();
+        return 1;
+    }
+
+    printStatsArg = args.stats;
+    profileArg = args.profileArg;
+    lazyArg = args.lazy;
+    memLimitPages = args.memLimit / GUEST_PAGE_SIZE;
+    defaultDurability = args.durability;
+    fileDurability = args.fileDurability;
+    maxRunning = args.maxRunning;
+    runAdmitted = maxRunning;
+    sliceNs = args.sliceMs * 1000000ULL;
+
+    if(!args.replayArg.empty()) {
+        if(args.replayDirArg.empty()) {
+            printUsage();
+            return 1;
+        }
+        return replayTrace(args.replayArg, args.replayTiming, args.replayDirArg);
+    }
+
+    if(args.daemonArg.empty() && (args.memoryArg == 0 || args.pageArg == 0 || args.guestArgs.empty())) {
+        printUsage();
         return 1;
     }
 
+    vector<string> &guestArgs = args.guestArgs;
     for(size_t i = 0; i < guestArgs.size(); i++) {
         for(size_t j = i + 1; j < guestArgs.size(); j++) {
             if(guestArgs[i] == guestArgs[j]) {
@@ -506,22 +2982,99 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    struct vmArgs vmArgs;
-    vmArgs.memoryArg = memoryArg;
-    vmArgs.pageArg = pageArg;
-    vmArgs.fileArgs = fileArgs;
+    sem_init(&mutex, 0, 1);
+    sem_init(&traceMutex, 0, 1);
+    sem_init(&poolMutex, 0, 1);
+    sem_init(&jobsMutex, 0, 1);
+    sem_init(&jobsAvailable, 0, 0);
+    sem_init(&vcpusMutex, 0, 1);
+    sem_init(&pagerMutex, 0, 1);
+    guestSse = probe_sse();
+
+    //daemon jobs may bring their own time limits
+    bool scheduling = maxRunning > 0 || args.timeLimitNs > 0 || args.cpuLimitNs > 0 || !args.daemonArg.empty();
+    thread profilerThread;
+    thread schedulerThread;
+    if(profileArg > 0 || memLimitPages > 0 || scheduling) {
+        install_kick_handler();
+    }
+    if(profileArg > 0) {
+        profilerThread = thread(profiler, profileArg);
+    }
+    if(scheduling) {
+        schedulerThread = thread(scheduler);
+    }
+
+    //the pager blocks in epoll_wait for as long as the process lives
+    if(lazyArg) {
+        pagerEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if(pagerEpoll < 0) {
+            perror("epoll_create1");
+            return 1;
+        }
+        thread(pager).detach();
+    }
+
+    if(!args.traceArg.empty()) {
+        traceFile = fopen(args.traceArg.c_str(), "wb");
+        if(traceFile == NULL) {
+            perror("open trace");
+            return 1;
+        }
+        fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), traceFile);
+        traceStart = nowNs();
+    }
+
+    if(init_shm(args.shmArgs) < 0) {
+        destroy_shm();
+        return 1;
+    }
 
+    flusherRunning = true;
+    thread flusherThread(flusher);
+
+    if(!args.daemonArg.empty()) {
+        int ret = runDaemon(args);
+        stopFlusher(flusherThread);
+        profilerStop = true;
+        schedulerStop = true;
+        if(profilerThread.joinable()) profilerThread.join();
+        if(schedulerThread.joinable()) schedulerThread.join();
+        if(traceFile != NULL) fclose(traceFile);
+        destroy_shm();
+        return ret;
+    }
+
+    //every guest counts as a peer from the start, so an early waiter does not miss a later one
+    shmAttach(guestArgs.size());
     vector<thread> threads;
-    for(const auto& guestArg : guestArgs) {
-        vmArgs.guestArg = guestArg;
-        threads.emplace_back(vmRunner, vmArgs);
+    for(size_t i = 0; i < guestArgs.size(); i++) {
+        threads.emplace_back(vmRunner, makeVmArgs(args, guestArgs[i], i));
     }
 
     for(auto& thread : threads) {
         thread.join();
     }
+    stopFlusher(flusherThread);
+
+    profilerStop = true;
+    schedulerStop = true;
+    if(profilerThread.joinable()) profilerThread.join();
+    if(schedulerThread.joinable()) schedulerThread.join();
+
+    if(traceFile != NULL) {
+        fclose(traceFile);
+    }
 
+    destroy_shm();
+
+    sem_destroy(&pagerMutex);
+    sem_destroy(&vcpusMutex);
+    sem_destroy(&jobsAvailable);
+    sem_destroy(&jobsMutex);
+    sem_destroy(&poolMutex);
+    sem_destroy(&traceMutex);
     sem_destroy(&mutex);
 
     return 0;
-}
\ No newline at end of file
+}